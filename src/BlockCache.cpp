@@ -0,0 +1,40 @@
+#include "BlockCache.h"
+
+uint64_t BlockCache::hash(const ustring &data)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (unsigned char c : data) {
+		h ^= c;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+const BlockCache::Surface *BlockCache::find(uint64_t hash, const ustring &data)
+{
+	auto it = m_entries.find(hash);
+	if (it != m_entries.end() && it->second.data == data) {
+		hits++;
+		return &it->second.surface;
+	}
+	misses++;
+	return nullptr;
+}
+
+bool BlockCache::wants(uint64_t hash)
+{
+	// the first block with a given hash wins, collisions are just not cached
+	if (m_entries.size() >= MAX_ENTRIES || m_entries.count(hash) != 0)
+		return false;
+	// blocks that are seen only once should not take up space in the cache
+	if (m_seen.size() >= MAX_ENTRIES * 16)
+		m_seen.clear();
+	return !m_seen.insert(hash).second;
+}
+
+void BlockCache::add(uint64_t hash, const ustring &data, const Surface &surface)
+{
+	m_entries.emplace(hash, Entry{data, surface});
+	m_seen.erase(hash);
+}
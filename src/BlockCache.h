@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include "types.h"
+
+/*
+ * Remembers what identical map blocks look like from above, so that blocks
+ * which appear many times (e.g. untouched stone) are only decoded once.
+ * Not thread-safe, every thread has its own.
+ */
+class BlockCache
+{
+public:
+	enum {
+		MAX_DATA_SIZE = 512, // bigger blocks are unlikely to repeat
+		MAX_ENTRIES = 4096,
+	};
+
+	// Top surface of a block
+	struct Surface {
+		bool empty;
+		uint16_t node[16][16]; // topmost visible node, NodeTable::NONE if none
+		uint8_t y[16][16]; // its Y position inside the block
+	};
+
+	static bool eligible(const ustring &data) {
+		return data.size() <= MAX_DATA_SIZE;
+	}
+	static uint64_t hash(const ustring &data);
+
+	// returns the cached surface or nullptr, counts hits and misses
+	const Surface *find(uint64_t hash, const ustring &data);
+	// whether a missed block is worth adding (i.e. it was missed before)
+	bool wants(uint64_t hash);
+	void add(uint64_t hash, const ustring &data, const Surface &surface);
+
+	size_t hits = 0, misses = 0;
+
+private:
+	struct Entry {
+		ustring data; // to rule out hash collisions
+		Surface surface;
+	};
+
+	std::unordered_map<uint64_t, Entry> m_entries;
+	std::unordered_set<uint64_t> m_seen; // hashes of missed blocks
+};
@@ -11,6 +11,10 @@ class BufferReader {
 public:
 	BufferReader() = default;
 	BufferReader(const ustring &s) : buffer(s.c_str()), length(s.length()) {}
+	// reads from a zstd stream that is decompressed only as far as needed
+	BufferReader(ZstdDecompressor &z, ustring &s) : source(&z), sourceBuf(&s) {
+		z.start(s);
+	}
 
 	/// @brief Returns a pointer to the requested amount of bytes and advances the offset
 	const unsigned char *ptr(size_t requested);
@@ -30,19 +34,28 @@ public:
 		auto *p = ptr(2);
 		return (p[0] << 8) | p[1];
 	}
-	std::string str(size_t requested) {
+	// reads into an existing string to reuse its allocation
+	void str(size_t requested, std::string &dst) {
 		if (requested == 0)
-			return {};
-		return std::string(reinterpret_cast<const char*>(ptr(requested)), requested);
+			dst.clear();
+		else
+			dst.assign(reinterpret_cast<const char*>(ptr(requested)), requested);
 	}
 
 private:
 	const unsigned char *buffer = nullptr;
 	size_t offset = 0, length = 0;
+	ZstdDecompressor *source = nullptr;
+	ustring *sourceBuf = nullptr;
 };
 
 const unsigned char *BufferReader::ptr(size_t requested)
 {
+	if (length - offset < requested && source) {
+		source->fill(*sourceBuf, offset + requested);
+		buffer = sourceBuf->c_str();
+		length = sourceBuf->size();
+	}
 	if (length - offset < requested) {
 		std::string msg("Reading outside buffer: offset=");
 		msg.append(std::to_string(offset)).append(" length=").append(std::to_string(length))
@@ -56,35 +69,22 @@ const unsigned char *BufferReader::ptr(size_t requested)
 
 }
 
-static inline uint16_t readBlockContent(const unsigned char *mapData,
-	u8 contentWidth, unsigned int datapos)
-{
-	if (contentWidth == 2) {
-		size_t index = datapos << 1;
-		return (mapData[index] << 8) | mapData[index + 1];
-	} else {
-		u8 param = mapData[datapos];
-		if (param <= 0x7f)
-			return param;
-		else
-			return (param << 4) | (mapData[datapos + 0x2000] >> 4);
-	}
-}
-
-BlockDecoder::BlockDecoder()
+BlockDecoder::BlockDecoder(NodeTable &nodes) :
+	m_nodes(nodes)
 {
 	reset();
 }
 
 void BlockDecoder::reset()
 {
-	m_blockAirId = -1;
-	m_blockIgnoreId = -1;
-	m_nameMap.clear();
+	m_palette.clear();
+	m_mapped.clear();
+	m_empty = true;
+	m_uniform = INVALID;
 
 	m_version = 0;
 	m_contentWidth = 0;
-	m_mapData.clear();
+	m_content = nullptr;
 }
 
 void BlockDecoder::decode(const ustring &datastr)
@@ -99,10 +99,9 @@ void BlockDecoder::decode(const ustring &datastr)
 	m_version = version;
 
 	if (version >= 29) {
-		// decompress whole block at once
+		// decompress only as much as we need (see below)
 		m_zstd_decompressor.setData(reader.ptr(0), reader.remaining(), 0);
-		m_zstd_decompressor.decompress(m_scratch);
-		reader = BufferReader(m_scratch);
+		reader = BufferReader(m_zstd_decompressor, m_scratch);
 	}
 
 	if (version >= 29)
@@ -118,19 +117,33 @@ void BlockDecoder::decode(const ustring &datastr)
 		for (int i = 0; i < numMappings; ++i) {
 			uint16_t nodeId = reader.u16();
 			uint16_t nameLen = reader.u16();
-			std::string name = reader.str(nameLen);
-			if (name == "air")
-				m_blockAirId = nodeId;
-			else if (name == "ignore")
-				m_blockIgnoreId = nodeId;
-			else
-				m_nameMap[nodeId] = std::move(name);
+			reader.str(nameLen, m_name);
+			if (nodeId >= m_palette.size())
+				m_palette.resize(nodeId + 1, INVALID);
+			if (m_palette[nodeId] == INVALID)
+				m_mapped.push_back(nodeId);
+			if (m_name == "air" || m_name == "ignore") {
+				m_palette[nodeId] = NodeTable::NONE;
+				continue;
+			}
+			auto it = m_nodeIds.find(m_name);
+			if (it == m_nodeIds.end())
+				it = m_nodeIds.emplace(m_name, m_nodes.lookup(m_name)).first;
+			m_palette[nodeId] = it->second;
+			m_empty = false;
 		}
+		// the mapping only lists the nodes actually present in the block
+		if (numMappings == 1 && !m_empty)
+			m_uniform = m_palette[m_mapped.front()];
 	};
 
-	// Mapping comes early
-	if (version >= 29)
+	// Mapping comes early, and the node data isn't needed if it already
+	// tells everything
+	if (version >= 29) {
 		decode_mapping();
+		if (isEmpty() || isUniform())
+			return;
+	}
 
 	uint8_t contentWidth = reader.u8();
 	uint8_t paramsWidth = reader.u8();
@@ -146,18 +159,23 @@ void BlockDecoder::decode(const ustring &datastr)
 	const size_t mapDataSize = (contentWidth + paramsWidth) * 4096;
 
 	if (version >= 29) {
-		m_mapData.assign(reader.ptr(mapDataSize), mapDataSize);
+		// param1 and param2 are unused, except for the upper bits of
+		// one byte content IDs
+		const size_t size = contentWidth == 2 ? 2 * 4096 : mapDataSize;
+		// no copy needed, m_scratch stays untouched until the next block
+		m_content = reader.ptr(size);
 		return; // we have read everything we need and can return early
 	}
 
 	// version < 29
 	ZlibDecompressor decompressor(reader.ptr(0), reader.remaining());
 	decompressor.decompress(m_mapData);
-	decompressor.decompress(m_scratch); // unused metadata
+	decompressor.skip(); // unused metadata
 	reader.skip(decompressor.seekPos());
 
 	if (m_mapData.size() < mapDataSize)
 		throw std::runtime_error("Map data buffer truncated");
+	m_content = m_mapData.c_str();
 
 	// Skip unused node timers
 	if (version == 23)
@@ -187,21 +205,21 @@ void BlockDecoder::decode(const ustring &datastr)
 bool BlockDecoder::isEmpty() const
 {
 	// only contains ignore and air nodes?
-	return m_nameMap.empty();
+	return m_empty;
+}
+
+bool BlockDecoder::isUniform() const
+{
+	return m_uniform != INVALID;
 }
 
-const static std::string empty;
+uint16_t BlockDecoder::getUniformNode() const
+{
+	return m_uniform;
+}
 
-const std::string &BlockDecoder::getNode(u8 x, u8 y, u8 z) const
+uint16_t BlockDecoder::invalidNode(uint16_t content) const
 {
-	unsigned int position = x + (y << 4) + (z << 8);
-	uint16_t content = readBlockContent(m_mapData.c_str(), m_contentWidth, position);
-	if (content == m_blockAirId || content == m_blockIgnoreId)
-		return empty;
-	auto it = m_nameMap.find(content);
-	if (it == m_nameMap.end()) {
-		errorstream << "Skipping node with invalid ID " << (int)content << std::endl;
-		return empty;
-	}
-	return it->second;
+	errorstream << "Skipping node with invalid ID " << (int)content << std::endl;
+	return NodeTable::NONE;
 }
@@ -1,29 +1,90 @@
 #pragma once
 
 #include <cstdint>
+#include <string>
 #include <unordered_map>
+#include <vector>
 #include "types.h"
+#include "NodeTable.h"
 #include <ZstdDecompressor.h>
 
 class BlockDecoder {
 public:
-	BlockDecoder();
+	BlockDecoder(NodeTable &nodes);
 
 	void reset();
 	void decode(const ustring &data);
 	bool isEmpty() const;
-	// returns "" for air, ignore and invalid nodes
-	const std::string &getNode(u8 x, u8 y, u8 z) const;
+	// block consists of a single node type (see getUniformNode())
+	bool isUniform() const;
+	uint16_t getUniformNode() const;
+	// size of a content ID in bytes (1 or 2)
+	int getContentWidth() const { return m_contentWidth; }
+
+	/* returns NodeTable::NONE for air, ignore and invalid nodes
+	 * note: not available for empty and uniform blocks */
+	inline uint16_t getNode(u8 x, u8 y, u8 z) const {
+		return m_contentWidth == 2 ? getNode<2>(x, y, z) : getNode<1>(x, y, z);
+	}
+	// same, but for blocks known to have this content width
+	template<int ContentWidth>
+	inline uint16_t getNode(u8 x, u8 y, u8 z) const {
+		unsigned int position = x + (y << 4) + (z << 8);
+		uint16_t content = readContent<ContentWidth>(position);
+		if (content < m_palette.size() && m_palette[content] != INVALID)
+			return m_palette[content];
+		return invalidNode(content);
+	}
+
+	// content IDs of a row of nodes along X (big endian),
+	// only available if the content width is 2
+	inline const unsigned char *getRow(u8 y, u8 z) const {
+		return m_contentWidth == 2 ?
+			&m_content[((y << 4) + (z << 8)) << 1] : nullptr;
+	}
+	// calls func(content ID, node ID) for every entry of the name mapping
+	template<typename F>
+	void forEachMapping(F func) const {
+		for (uint16_t content : m_mapped)
+			func(content, m_palette[content]);
+	}
 
 private:
-	typedef std::unordered_map<uint16_t, std::string> NameMap;
-	NameMap m_nameMap;
-	uint16_t m_blockAirId, m_blockIgnoreId;
+	enum : uint16_t {
+		INVALID = UINT16_MAX, // not in the block's name mapping
+	};
+
+	template<int ContentWidth>
+	inline uint16_t readContent(unsigned int datapos) const {
+		static_assert(ContentWidth == 1 || ContentWidth == 2, "");
+		const unsigned char *mapData = m_content;
+		if (ContentWidth == 2) {
+			size_t index = datapos << 1;
+			return (mapData[index] << 8) | mapData[index + 1];
+		} else {
+			u8 param = mapData[datapos];
+			if (param <= 0x7f)
+				return param;
+			else
+				return (param << 4) | (mapData[datapos + 0x2000] >> 4);
+		}
+	}
+	uint16_t invalidNode(uint16_t content) const;
+
+	NodeTable &m_nodes;
+	std::unordered_map<std::string, uint16_t> m_nodeIds; // cache of m_nodes
+	std::vector<uint16_t> m_palette; // content ID -> node ID
+	std::vector<uint16_t> m_mapped; // content IDs in the name mapping
+	bool m_empty;
+	uint16_t m_uniform; // node ID if uniform, else INVALID
 
 	u8 m_version, m_contentWidth;
+	// node data, points into m_scratch or m_mapData
+	const unsigned char *m_content;
 	ustring m_mapData;
 
 	// cached allocations/instances for performance
 	ZstdDecompressor m_zstd_decompressor;
 	ustring m_scratch;
+	std::string m_name;
 };
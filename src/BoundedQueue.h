@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/* Thread-safe FIFO queue that holds at most a given number of items. */
+template<typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity) : m_capacity(capacity) {}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	// Waits while the queue is full. Returns false if the queue was closed.
+	bool push(T &&item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notFull.wait(lock, [this] {
+			return m_closed || m_queue.size() < m_capacity;
+		});
+		if (m_closed)
+			return false;
+		m_queue.emplace_back(std::move(item));
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	// Waits while the queue is empty. Returns false once the queue was
+	// closed and no items are left.
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notEmpty.wait(lock, [this] {
+			return m_closed || !m_queue.empty();
+		});
+		if (m_queue.empty())
+			return false;
+		item = std::move(m_queue.front());
+		m_queue.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	// No more items can be pushed, waiting threads are woken up.
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_notEmpty, m_notFull;
+	std::deque<T> m_queue;
+	size_t m_capacity;
+	bool m_closed = false;
+};
@@ -0,0 +1,180 @@
+#include <stdexcept>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "Encoder.h"
+#include "PngWriter.h"
+#include "Image.h"
+#include "util.h"
+
+namespace {
+
+bool endsWith(const std::string &s, const char *suffix)
+{
+	const size_t n = strlen(suffix);
+	return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Collects the image and hands it to gd at the end
+class GdEncoder : public Encoder {
+public:
+	GdEncoder(const std::string &filename, int width, int height) :
+		m_filename(filename), m_image(width, height), m_width(width), m_row(0), m_bytes(0)
+	{
+		if (filename == "-")
+			throw std::runtime_error("gd can't write to stdout");
+	}
+
+	void writeRow(const Color *row) override
+	{
+		for (int x = 0; x < m_width; x++)
+			m_image.setPixel(x, m_row, row[x]);
+		m_row++;
+	}
+
+	void finish() override
+	{
+		m_image.saveGd(m_filename);
+		m_bytes = file_size(m_filename.c_str());
+	}
+
+	size_t bytesWritten() const override { return m_bytes; }
+	bool buffered() const override { return true; }
+
+private:
+	std::string m_filename;
+	Image m_image;
+	int m_width, m_row;
+	size_t m_bytes;
+};
+
+// PPM without alpha or PAM with it, the pixels are simply written out
+class RawEncoder : public Encoder {
+public:
+	RawEncoder(const std::string &filename, int width, int height) :
+		m_width(width), m_bytes(0)
+	{
+		m_alpha = !endsWith(filename, ".ppm");
+		m_row.resize(width * (m_alpha ? 4 : 3));
+		m_file = open_output(filename);
+		char header[128];
+		if (m_alpha) {
+			snprintf(header, sizeof(header), "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\n"
+				"MAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+		} else {
+			snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+		}
+		try {
+			write(header, strlen(header));
+		} catch (...) {
+			// the destructor won't run
+			if (m_file != stdout)
+				fclose(m_file);
+			throw;
+		}
+	}
+
+	~RawEncoder()
+	{
+		if (m_file != stdout)
+			fclose(m_file);
+	}
+
+	void writeRow(const Color *row) override
+	{
+		u8 *out = &m_row[0];
+		for (int x = 0; x < m_width; x++) {
+			*out++ = row[x].r;
+			*out++ = row[x].g;
+			*out++ = row[x].b;
+			if (m_alpha)
+				*out++ = row[x].a;
+		}
+		write(m_row.data(), m_row.size());
+	}
+
+	void finish() override
+	{
+		if (fflush(m_file) != 0)
+			throw std::runtime_error("Error saving image");
+	}
+
+	size_t bytesWritten() const override { return m_bytes; }
+	bool buffered() const override { return false; }
+
+private:
+	void write(const void *data, size_t size)
+	{
+		if (fwrite(data, 1, size, m_file) != size)
+			throw std::runtime_error("Error saving image");
+		m_bytes += size;
+	}
+
+	FILE *m_file;
+	bool m_alpha;
+	int m_width;
+	size_t m_bytes;
+	ustring m_row;
+};
+
+// the PNG based encoders, target is a file name or a buffer
+template<typename Target>
+Encoder *createPngWriter(int encoder, const EncoderOptions &options, Target target,
+	int width, int height)
+{
+	switch (encoder) {
+		case ENCODER_FASTPNG:
+			// "up" is the cheapest filter that still helps a lot with maps
+			return new PngWriter(target, width, height,
+				options.level < 0 ? 1 : options.level,
+				options.filter < 0 ? PNG_FILTER_UP : options.filter,
+				options.threads, {});
+		case ENCODER_PALETTE:
+			assert(!options.palette.empty());
+			// filtering rarely helps with indices, the PNG spec advises against it
+			return new PngWriter(target, width, height, options.level,
+				options.filter < 0 ? PNG_FILTER_NONE : options.filter,
+				options.threads, options.palette);
+		default:
+			assert(encoder == ENCODER_PNG);
+			return new PngWriter(target, width, height, options.level,
+				options.filter < 0 ? PNG_FILTER_ADAPTIVE : options.filter,
+				options.threads, {});
+	}
+}
+
+}
+
+int pickEncoder(const EncoderOptions &options, const std::string &filename)
+{
+	if (options.encoder != ENCODER_AUTO)
+		return options.encoder;
+	if (filename == "-" || endsWith(filename, ".png"))
+		return ENCODER_PNG;
+	if (endsWith(filename, ".ppm") || endsWith(filename, ".pam"))
+		return ENCODER_RAW;
+	return ENCODER_GD;
+}
+
+Encoder *createEncoder(const EncoderOptions &options, const std::string &filename,
+	int width, int height)
+{
+	const int encoder = pickEncoder(options, filename);
+	switch (encoder) {
+		case ENCODER_GD:
+			return new GdEncoder(filename, width, height);
+		case ENCODER_RAW:
+			return new RawEncoder(filename, width, height);
+		default:
+			return createPngWriter(encoder, options, filename, width, height);
+	}
+}
+
+Encoder *createEncoder(const EncoderOptions &options, ustring *out, int width, int height)
+{
+	const int encoder = options.encoder == ENCODER_AUTO ? ENCODER_PNG : options.encoder;
+	if (encoder == ENCODER_GD || encoder == ENCODER_RAW)
+		throw std::runtime_error("Only PNG images can be kept in memory");
+	return createPngWriter(encoder, options, out, width, height);
+}
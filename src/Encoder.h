@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Image.h"
+
+enum {
+	ENCODER_AUTO,    // PNG for .png files, gd for everything else
+	ENCODER_PNG,     // our own PNG writer, best compression
+	ENCODER_FASTPNG, // same with low compression and a fixed filter
+	ENCODER_GD,      // libgd, supports all the formats it was built with
+	ENCODER_PALETTE, // PNG with up to 256 colors, see EncoderOptions::palette
+	ENCODER_RAW,     // uncompressed PPM or PAM, for other tools to read quickly
+};
+
+enum {
+	PNG_FILTER_NONE, // same numbers as in the file format
+	PNG_FILTER_SUB,
+	PNG_FILTER_UP,
+	PNG_FILTER_AVERAGE,
+	PNG_FILTER_PAETH,
+	PNG_FILTER_ADAPTIVE, // pick the one that likely compresses best per row
+};
+
+struct EncoderOptions {
+	int encoder = ENCODER_AUTO;
+	int level = -1; // compression level, -1 to let the encoder decide
+	int filter = -1; // PNG filter, -1 to let the encoder decide
+	int threads = 1;
+	// colors for ENCODER_PALETTE (at most 256), the nearest one is used for each pixel
+	std::vector<Color> palette;
+};
+
+/*
+ * Writes an image file one row at a time, rows go from top to bottom.
+ * Whether the whole image is kept in memory until finish() depends on
+ * the encoder.
+ */
+class Encoder {
+public:
+	virtual ~Encoder() {}
+
+	// row needs to have as many pixels as the image is wide
+	virtual void writeRow(const Color *row) = 0;
+	// all rows must have been written by then
+	virtual void finish() = 0;
+	// size of the file so far
+	virtual size_t bytesWritten() const = 0;
+	// if the whole image is kept in memory until the end
+	virtual bool buffered() const = 0;
+};
+
+// the encoder that will be used for the file name (resolves ENCODER_AUTO)
+int pickEncoder(const EncoderOptions &options, const std::string &filename);
+
+Encoder *createEncoder(const EncoderOptions &options, const std::string &filename,
+	int width, int height);
+
+// same, but the file is appended to out (only PNG based encoders, auto is PNG)
+Encoder *createEncoder(const EncoderOptions &options, ustring *out, int width, int height);
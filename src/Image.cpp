@@ -4,10 +4,16 @@
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <memory>
 #include <gd.h>
 #include <gdfontmb.h>
 
 #include "Image.h"
+#include "Encoder.h"
+#include "util.h"
 
 #ifndef NDEBUG
 #define SIZECHECK(x, y) check_bounds((x), (y), m_width, m_height)
@@ -34,6 +40,38 @@ static inline Color int2color(int c)
 	return c2;
 }
 
+// what a color looks like after a roundtrip through gd
+static inline Color quantize(const Color &c)
+{
+	if (c.a == 255)
+		return c;
+	return int2color(color2int(c));
+}
+
+// same as gdAlphaBlend()
+static inline Color alphaBlend(const Color &dst, const Color &src)
+{
+	const int src_alpha = (255 - src.a) * gdAlphaMax / 255;
+	if (src_alpha == gdAlphaOpaque)
+		return Color(src.r, src.g, src.b);
+	const int dst_alpha = (255 - dst.a) * gdAlphaMax / 255;
+	if (src_alpha == gdAlphaTransparent)
+		return dst;
+	if (dst_alpha == gdAlphaTransparent)
+		return quantize(src);
+
+	const int src_weight = gdAlphaTransparent - src_alpha;
+	const int dst_weight = (gdAlphaTransparent - dst_alpha) * src_alpha / gdAlphaMax;
+	const int tot_weight = src_weight + dst_weight;
+	const int alpha = src_alpha * dst_alpha / gdAlphaMax;
+	Color c;
+	c.r = (src.r * src_weight + dst.r * dst_weight) / tot_weight;
+	c.g = (src.g * src_weight + dst.g * dst_weight) / tot_weight;
+	c.b = (src.b * src_weight + dst.b * dst_weight) / tot_weight;
+	c.a = 255 - (alpha * 255 / gdAlphaMax);
+	return c;
+}
+
 #ifndef NDEBUG
 static inline void check_bounds(int x, int y, int width, int height)
 {
@@ -53,40 +91,177 @@ static inline void check_bounds(int x, int y, int width, int height)
 #endif
 
 
+constexpr int Image::TILE_SIZE;
+
 Image::Image(int width, int height) :
-	m_width(width), m_height(height), m_image(nullptr)
+	m_width(width), m_height(height), m_usedTiles(0), m_peakTiles(0),
+	m_image(nullptr)
 {
 	SIZECHECK(0, 0);
-	m_image = gdImageCreateTrueColor(m_width, m_height);
+	m_tilesX = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+	m_tilesY = (m_height + TILE_SIZE - 1) / TILE_SIZE;
+	m_tiles.reset(new std::atomic<Color*>[m_tilesX * m_tilesY]);
+	for (int i = 0; i < m_tilesX * m_tilesY; i++)
+		m_tiles[i] = nullptr;
+	// a new gd image is black, so is this
+	m_background = Color(0, 0, 0);
 }
 
 Image::~Image()
 {
-	gdImageDestroy(m_image);
+	freeTiles();
+	if (m_image)
+		gdImageDestroy(m_image);
+}
+
+Color *Image::findTile(int tx, int ty) const
+{
+	return m_tiles[ty * m_tilesX + tx].load(std::memory_order_acquire);
+}
+
+Color *Image::getTile(int tx, int ty)
+{
+	auto &slot = m_tiles[ty * m_tilesX + tx];
+	Color *tile = slot.load(std::memory_order_acquire);
+	if (tile)
+		return tile;
+
+	// several threads may draw into the same tile, only one allocation wins
+	Color *fresh = new Color[TILE_SIZE * TILE_SIZE];
+	std::fill(fresh, fresh + TILE_SIZE * TILE_SIZE, m_background);
+	if (slot.compare_exchange_strong(tile, fresh, std::memory_order_acq_rel)) {
+		const int used = ++m_usedTiles;
+		int peak = m_peakTiles;
+		while (used > peak && !m_peakTiles.compare_exchange_weak(peak, used))
+			;
+		return fresh;
+	}
+	delete[] fresh;
+	return tile;
+}
+
+void Image::freeTiles()
+{
+	if (!m_tiles)
+		return;
+	for (int i = 0; i < m_tilesX * m_tilesY; i++)
+		delete[] m_tiles[i].load();
+	m_tiles.reset();
+}
+
+void Image::writeSpan(int x, int y, const Color *src, int n)
+{
+	while (n > 0) {
+		const int x2 = x % TILE_SIZE;
+		const int len = std::min(n, TILE_SIZE - x2);
+		Color *tile = getTile(x / TILE_SIZE, y / TILE_SIZE);
+		std::copy(src, src + len, &tile[(y % TILE_SIZE) * TILE_SIZE + x2]);
+		x += len;
+		src += len;
+		n -= len;
+	}
+}
+
+void Image::toGd()
+{
+	if (m_image)
+		return;
+	m_image = gdImageCreateTrueColor(m_width, m_height);
+	const int background = color2int(m_background);
+	for (int y = 0; y < m_height; y++) {
+		int *out = m_image->tpixels[y];
+		for (int tx = 0; tx < m_tilesX; tx++) {
+			const int x = tx * TILE_SIZE;
+			const int w = std::min(TILE_SIZE, m_width - x);
+			const Color *tile = findTile(tx, y / TILE_SIZE);
+			if (!tile) {
+				std::fill(out + x, out + x + w, background);
+				continue;
+			}
+			const Color *row = &tile[(y % TILE_SIZE) * TILE_SIZE];
+			for (int x2 = 0; x2 < w; x2++)
+				out[x + x2] = color2int(row[x2]);
+		}
+	}
+	freeTiles();
 }
 
 void Image::setPixel(int x, int y, const Color &c)
 {
 	SIZECHECK(x, y);
-	m_image->tpixels[y][x] = color2int(c);
+	if (m_image) {
+		m_image->tpixels[y][x] = color2int(c);
+		return;
+	}
+	Color *tile = getTile(x / TILE_SIZE, y / TILE_SIZE);
+	tile[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE] = quantize(c);
 }
 
-Color Image::getPixel(int x, int y)
+Color Image::getPixel(int x, int y) const
 {
 	SIZECHECK(x, y);
-	return int2color(m_image->tpixels[y][x]);
+	if (m_image)
+		return int2color(m_image->tpixels[y][x]);
+	const Color *tile = findTile(x / TILE_SIZE, y / TILE_SIZE);
+	if (!tile)
+		return m_background;
+	return tile[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+}
+
+Color *Image::getTileRow(int tx, int y)
+{
+	SIZECHECK(tx * TILE_SIZE, y);
+	assert(!m_image);
+	Color *tile = findTile(tx, y / TILE_SIZE);
+	if (!tile)
+		return nullptr;
+	return &tile[(y % TILE_SIZE) * TILE_SIZE];
+}
+
+void Image::readRow(int y, Color *out) const
+{
+	SIZECHECK(0, y);
+	if (m_image) {
+		for (int x = 0; x < m_width; x++)
+			out[x] = int2color(m_image->tpixels[y][x]);
+		return;
+	}
+	for (int tx = 0; tx < m_tilesX; tx++) {
+		const int x = tx * TILE_SIZE;
+		const int w = std::min(TILE_SIZE, m_width - x);
+		const Color *tile = findTile(tx, y / TILE_SIZE);
+		if (tile)
+			std::copy(&tile[(y % TILE_SIZE) * TILE_SIZE], &tile[(y % TILE_SIZE) * TILE_SIZE + w], out + x);
+		else
+			std::fill(out + x, out + x + w, m_background);
+	}
+}
+
+void Image::discardRows(int y)
+{
+	assert(!m_image);
+	for (int ty = 0; (ty + 1) * TILE_SIZE <= y && ty < m_tilesY; ty++) {
+		for (int tx = 0; tx < m_tilesX; tx++) {
+			Color *tile = m_tiles[ty * m_tilesX + tx].exchange(nullptr);
+			if (tile)
+				m_usedTiles--;
+			delete[] tile;
+		}
+	}
 }
 
 void Image::drawLine(int x1, int y1, int x2, int y2, const Color &c)
 {
 	SIZECHECK(x1, y1);
 	SIZECHECK(x2, y2);
+	toGd();
 	gdImageLine(m_image, x1, y1, x2, y2, color2int(c));
 }
 
 void Image::drawText(int x, int y, const std::string &s, const Color &c)
 {
 	SIZECHECK(x, y);
+	toGd();
 	gdImageString(m_image, gdFontGetMediumBold(), x, y, (unsigned char*) s.c_str(), color2int(c));
 }
 
@@ -94,17 +269,104 @@ void Image::drawFilledRect(int x, int y, int w, int h, const Color &c)
 {
 	SIZECHECK(x, y);
 	SIZECHECK(x + w - 1, y + h - 1);
-	gdImageFilledRectangle(m_image, x, y, x + w - 1, y + h - 1, color2int(c));
+	if (m_image) {
+		gdImageFilledRectangle(m_image, x, y, x + w - 1, y + h - 1, color2int(c));
+		return;
+	}
+	if (x == 0 && y == 0 && w == m_width && h == m_height) {
+		// whole image: change the background, touching only existing tiles
+		m_background = alphaBlend(m_background, c);
+		for (int i = 0; i < m_tilesX * m_tilesY; i++) {
+			Color *tile = m_tiles[i].load();
+			if (!tile)
+				continue;
+			for (int j = 0; j < TILE_SIZE * TILE_SIZE; j++)
+				tile[j] = alphaBlend(tile[j], c);
+		}
+		return;
+	}
+	for (int y2 = y; y2 < y + h; y2++) {
+		for (int x2 = x; x2 < x + w; x2++) {
+			Color *tile = getTile(x2 / TILE_SIZE, y2 / TILE_SIZE);
+			Color &p = tile[(y2 % TILE_SIZE) * TILE_SIZE + x2 % TILE_SIZE];
+			p = alphaBlend(p, c);
+		}
+	}
 }
 
 void Image::drawCircle(int x, int y, int diameter, const Color &c)
 {
 	SIZECHECK(x, y);
+	toGd();
 	gdImageArc(m_image, x, y, diameter, diameter, 0, 360, color2int(c));
 }
 
-void Image::save(const std::string &filename)
+void Image::drawScaled(const Image &src, int x, int y, int zoom)
+{
+	SIZECHECK(x, y);
+	SIZECHECK(x + src.m_width * zoom - 1, y + src.m_height * zoom - 1);
+	if (m_image || src.m_image) {
+		for (int sy = 0; sy < src.m_height; sy++) {
+			for (int sx = 0; sx < src.m_width; sx++) {
+				Color c = src.getPixel(sx, sy);
+				for (int i = 0; i < zoom * zoom; i++)
+					setPixel(x + sx * zoom + i % zoom, y + sy * zoom + i / zoom, c);
+			}
+		}
+		return;
+	}
+
+	// untouched tiles can be skipped if they look the same here
+	const bool sameBackground = src.m_background.r == m_background.r &&
+		src.m_background.g == m_background.g &&
+		src.m_background.b == m_background.b &&
+		src.m_background.a == m_background.a;
+	const std::vector<Color> blank(TILE_SIZE, src.m_background);
+	std::vector<Color> line(TILE_SIZE * zoom);
+	for (int ty = 0; ty < src.m_tilesY; ty++) {
+		for (int tx = 0; tx < src.m_tilesX; tx++) {
+			const Color *tile = src.findTile(tx, ty);
+			if (!tile && sameBackground)
+				continue;
+			const int w = std::min(TILE_SIZE, src.m_width - tx * TILE_SIZE);
+			const int h = std::min(TILE_SIZE, src.m_height - ty * TILE_SIZE);
+			// scale up one row, then copy it as many times as needed
+			for (int sy = 0; sy < h; sy++) {
+				const Color *in = tile ? &tile[sy * TILE_SIZE] : blank.data();
+				for (int sx = 0; sx < w; sx++) {
+					for (int i = 0; i < zoom; i++)
+						line[sx * zoom + i] = in[sx];
+				}
+				const int x2 = x + tx * TILE_SIZE * zoom;
+				const int y2 = y + (ty * TILE_SIZE + sy) * zoom;
+				for (int i = 0; i < zoom; i++)
+					writeSpan(x2, y2 + i, line.data(), w * zoom);
+			}
+		}
+	}
+}
+
+size_t Image::save(const std::string &filename, const EncoderOptions &options)
+{
+	if (pickEncoder(options, filename) == ENCODER_GD) {
+		// gd can use the image directly
+		saveGd(filename);
+		return file_size(filename.c_str());
+	}
+
+	std::unique_ptr<Encoder> encoder(createEncoder(options, filename, m_width, m_height));
+	std::vector<Color> row(m_width);
+	for (int y = 0; y < m_height; y++) {
+		readRow(y, row.data());
+		encoder->writeRow(row.data());
+	}
+	encoder->finish();
+	return encoder->bytesWritten();
+}
+
+void Image::saveGd(const std::string &filename)
 {
+	toGd();
 #if (GD_MAJOR_VERSION == 2 && GD_MINOR_VERSION == 1 && GD_RELEASE_VERSION >= 1) || (GD_MAJOR_VERSION == 2 && GD_MINOR_VERSION > 1) || GD_MAJOR_VERSION > 2
 	const char *f = filename.c_str();
 	if (gdSupportsFileType(f, 1) == GD_FALSE)
@@ -2,8 +2,12 @@
 
 #include "types.h"
 #include <string>
+#include <atomic>
+#include <memory>
 #include <gd.h>
 
+struct EncoderOptions;
+
 struct Color {
 	Color() : r(0), g(0), b(0), a(0) {};
 	Color(u8 r, u8 g, u8 b) : r(r), g(g), b(b), a(255) {};
@@ -14,6 +18,9 @@ struct Color {
 
 class Image {
 public:
+	// pixels are kept in square tiles of this size, see m_tiles
+	static constexpr int TILE_SIZE = 256;
+
 	Image(int width, int height);
 	~Image();
 
@@ -21,14 +28,47 @@ public:
 	Image& operator=(const Image&) = delete;
 
 	void setPixel(int x, int y, const Color &c);
-	Color getPixel(int x, int y);
+	Color getPixel(int x, int y) const;
+	/* direct access to the part of row y inside the tile column tx, only until
+	 * gd is needed (see toGd()). nullptr if nothing was drawn to that tile. */
+	Color *getTileRow(int tx, int y);
+	// copies row y to out, which needs to have room for the image width
+	void readRow(int y, Color *out) const;
+	// frees all tiles above row y, which must not be accessed anymore
+	void discardRows(int y);
+	// the most tiles that were in memory at once, out of tileCount()
+	int peakTiles() const { return m_peakTiles; }
+	int tileCount() const { return m_tilesX * m_tilesY; }
 	void drawLine(int x1, int y1, int x2, int y2, const Color &c);
 	void drawText(int x, int y, const std::string &s, const Color &c);
 	void drawFilledRect(int x, int y, int w, int h, const Color &c);
 	void drawCircle(int x, int y, int diameter, const Color &c);
-	void save(const std::string &filename);
+	// copies another image to (x, y), each pixel becoming a zoom*zoom square
+	void drawScaled(const Image &src, int x, int y, int zoom);
+	// returns the size of the file
+	size_t save(const std::string &filename, const EncoderOptions &options);
+	// saves the image with gd, the format depends on the file name
+	void saveGd(const std::string &filename);
 
 private:
+	// switches from m_tiles to gd, needed for everything but plain pixels
+	void toGd();
+	// returns the tile at (tx, ty), allocating it if needed
+	Color *getTile(int tx, int ty);
+	// same but returns nullptr for tiles that were never drawn to
+	Color *findTile(int tx, int ty) const;
+	// copies n pixels to (x, y) onwards, which may span several tiles
+	void writeSpan(int x, int y, const Color *src, int n);
+	void freeTiles();
+
 	int m_width, m_height;
+	/* map rendering happens in these tiles (row-major, each one also row-major),
+	 * converting to a gd image happens only once needed and then m_image is
+	 * used instead. Tiles are allocated on first write, so huge maps with
+	 * few built areas stay small. All other pixels have m_background. */
+	int m_tilesX, m_tilesY;
+	std::unique_ptr<std::atomic<Color*>[]> m_tiles;
+	std::atomic<int> m_usedTiles, m_peakTiles;
+	Color m_background;
 	gdImagePtr m_image;
 };
@@ -0,0 +1,194 @@
+#include <memory>
+#include <initializer_list>
+#include <cstdio>
+#include <stdexcept>
+
+#include "MBTiles.h"
+
+// tiles per transaction
+static constexpr size_t BATCH_SIZE = 4096;
+
+MBTilesStore::MBTilesStore(const std::string &path, const EncoderOptions &options,
+	uint64_t settings, int maxZoom) :
+	m_options(options), m_settings(settings), m_maxZoom(maxZoom),
+	m_bytes(0), m_uncommitted(0)
+{
+	if (options.encoder == ENCODER_GD || options.encoder == ENCODER_RAW)
+		throw std::runtime_error("MBTiles can only hold PNG tiles");
+
+	// the name without directory and extension
+	const size_t slash = path.find_last_of("/\\");
+	m_name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+	m_name = m_name.substr(0, m_name.rfind('.'));
+
+	// the destructor won't run if this throws
+	try {
+		openDatabase(path.c_str(), false);
+		exec("PRAGMA journal_mode = WAL");
+		exec("PRAGMA synchronous = NORMAL");
+		exec("CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT)");
+		exec("CREATE TABLE IF NOT EXISTS map (zoom_level INTEGER, tile_column INTEGER, "
+			"tile_row INTEGER, tile_id INTEGER, "
+			"PRIMARY KEY (zoom_level, tile_column, tile_row))");
+		exec("CREATE TABLE IF NOT EXISTS images (tile_id INTEGER PRIMARY KEY, tile_data BLOB)");
+		exec("CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, "
+			"map.tile_column AS tile_column, map.tile_row AS tile_row, "
+			"images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id");
+
+		check_result(prepare(m_insertMap, "INSERT OR REPLACE INTO map "
+			"(zoom_level, tile_column, tile_row, tile_id) VALUES (?, ?, ?, ?)"));
+		check_result(prepare(m_insertImage, "INSERT OR IGNORE INTO images "
+			"(tile_id, tile_data) VALUES (?, ?)"));
+		check_result(prepare(m_deleteMap, "DELETE FROM map "
+			"WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?"));
+		check_result(prepare(m_setMetadata, "INSERT OR REPLACE INTO metadata "
+			"(name, value) VALUES (?, ?)"));
+
+		exec("BEGIN");
+
+		// tiles from an earlier run can only be kept if they were encoded the same way
+		char hex[17];
+		snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(m_settings));
+		sqlite3_stmt *stmt;
+		check_result(prepare(stmt,
+			"SELECT value FROM metadata WHERE name = 'minetestmapper_settings'"));
+		bool same = sqlite3_step(stmt) == SQLITE_ROW && read_str(stmt, 0) == hex;
+		sqlite3_finalize(stmt);
+		if (!same) {
+			exec("DELETE FROM map");
+			exec("DELETE FROM images");
+			return;
+		}
+
+		check_result(prepare(stmt,
+			"SELECT zoom_level, tile_column, tile_row, tile_id FROM map"));
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			const uint64_t key = tileKey(sqlite3_column_int(stmt, 0),
+				sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2));
+			m_previous[key] = sqlite3_column_int64(stmt, 3);
+		}
+		sqlite3_finalize(stmt);
+		check_result(prepare(stmt, "SELECT tile_id FROM images"));
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+			m_images.insert(sqlite3_column_int64(stmt, 0));
+		sqlite3_finalize(stmt);
+	} catch (...) {
+		close();
+		throw;
+	}
+}
+
+MBTilesStore::~MBTilesStore()
+{
+	close();
+}
+
+void MBTilesStore::close()
+{
+	for (sqlite3_stmt **stmt : {&m_insertMap, &m_insertImage, &m_deleteMap, &m_setMetadata}) {
+		sqlite3_finalize(*stmt);
+		*stmt = NULL;
+	}
+	// what was committed so far is consistent
+	if (db && !sqlite3_get_autocommit(db))
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+}
+
+void MBTilesStore::exec(const char *sql)
+{
+	check_result(sqlite3_exec(db, sql, NULL, NULL, NULL));
+}
+
+void MBTilesStore::step(sqlite3_stmt *stmt)
+{
+	check_result(sqlite3_step(stmt), SQLITE_DONE);
+	sqlite3_reset(stmt);
+}
+
+int MBTilesStore::reuse(int z, int x, int y, uint64_t hash)
+{
+	y = (1 << z) - 1 - y;
+	auto prev = m_previous.find(tileKey(z, x, y));
+	const bool unchanged = prev != m_previous.end() && prev->second == hash;
+	if (prev != m_previous.end())
+		m_previous.erase(prev);
+	if (unchanged)
+		return TILE_UNCHANGED;
+	if (!m_images.count(hash))
+		return TILE_ENCODE;
+	insertMap(z, x, y, hash);
+	tileDone();
+	return TILE_LINKED;
+}
+
+void MBTilesStore::write(int z, int x, int y, uint64_t hash,
+	const Color *pixels, int stride)
+{
+	m_data.clear();
+	std::unique_ptr<Encoder> encoder(createEncoder(m_options, &m_data,
+		TileWriter::TILE_SIZE, TileWriter::TILE_SIZE));
+	for (int i = 0; i < TileWriter::TILE_SIZE; i++)
+		encoder->writeRow(&pixels[i * stride]);
+	encoder->finish();
+
+	sqlite3_bind_int64(m_insertImage, 1, hash);
+	sqlite3_bind_blob(m_insertImage, 2, m_data.data(), m_data.size(), SQLITE_STATIC);
+	step(m_insertImage);
+	m_images.insert(hash);
+	m_bytes += m_data.size();
+
+	insertMap(z, x, (1 << z) - 1 - y, hash);
+	tileDone();
+}
+
+void MBTilesStore::insertMap(int z, int x, int y, uint64_t hash)
+{
+	sqlite3_bind_int(m_insertMap, 1, z);
+	sqlite3_bind_int(m_insertMap, 2, x);
+	sqlite3_bind_int(m_insertMap, 3, y);
+	sqlite3_bind_int64(m_insertMap, 4, hash);
+	step(m_insertMap);
+}
+
+void MBTilesStore::setMetadata(const char *name, const std::string &value)
+{
+	sqlite3_bind_text(m_setMetadata, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(m_setMetadata, 2, value.c_str(), -1, SQLITE_TRANSIENT);
+	step(m_setMetadata);
+}
+
+void MBTilesStore::tileDone()
+{
+	if (++m_uncommitted < BATCH_SIZE)
+		return;
+	exec("COMMIT");
+	exec("BEGIN");
+	m_uncommitted = 0;
+}
+
+size_t MBTilesStore::finish()
+{
+	// what's left are tiles outside of the map by now
+	for (const auto &it : m_previous) {
+		sqlite3_bind_int(m_deleteMap, 1, it.first >> 48);
+		sqlite3_bind_int(m_deleteMap, 2, (it.first >> 24) & 0xffffff);
+		sqlite3_bind_int(m_deleteMap, 3, it.first & 0xffffff);
+		step(m_deleteMap);
+	}
+	const size_t removed = m_previous.size();
+	m_previous.clear();
+	exec("DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map)");
+
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(m_settings));
+	setMetadata("name", m_name);
+	setMetadata("format", "png");
+	setMetadata("type", "baselayer");
+	setMetadata("minzoom", "0");
+	setMetadata("maxzoom", std::to_string(m_maxZoom));
+	setMetadata("minetestmapper_settings", hex);
+	exec("COMMIT");
+	// leave a single file behind
+	exec("PRAGMA wal_checkpoint(TRUNCATE)");
+	return removed;
+}
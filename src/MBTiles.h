@@ -0,0 +1,57 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include "TileWriter.h"
+#include "db-sqlite3.h"
+
+/*
+ * Tiles in a single SQLite file following the MBTiles spec. Like most
+ * writers do, every distinct tile is stored once in "images" and "map"
+ * refers to it, the "tiles" view puts them together for readers.
+ * Note that MBTiles counts tile rows from the bottom.
+ */
+class MBTilesStore : public TileStore, private SQLite3Base {
+public:
+	MBTilesStore(const std::string &path, const EncoderOptions &options,
+		uint64_t settings, int maxZoom);
+	~MBTilesStore();
+
+	int reuse(int z, int x, int y, uint64_t hash) override;
+	void write(int z, int x, int y, uint64_t hash,
+		const Color *pixels, int stride) override;
+	size_t finish() override;
+	size_t bytesWritten() const override { return m_bytes; }
+
+private:
+	static uint64_t tileKey(int z, int x, int y)
+	{
+		return (uint64_t(z) << 48) | (uint64_t(uint32_t(x)) << 24) | uint32_t(y);
+	}
+
+	// finalizes the statements and drops what isn't committed
+	void close();
+	void exec(const char *sql);
+	void step(sqlite3_stmt *stmt);
+	void insertMap(int z, int x, int y, uint64_t hash);
+	void setMetadata(const char *name, const std::string &value);
+	// commits from time to time so the WAL doesn't grow too much
+	void tileDone();
+
+	EncoderOptions m_options;
+	uint64_t m_settings;
+	int m_maxZoom;
+	std::string m_name;
+	size_t m_bytes;
+	size_t m_uncommitted;
+	ustring m_data;
+
+	// from the last run, minus the tiles written since
+	std::unordered_map<uint64_t, uint64_t> m_previous;
+	std::unordered_set<uint64_t> m_images; // hashes that are stored
+
+	sqlite3_stmt *m_insertMap = NULL;
+	sqlite3_stmt *m_insertImage = NULL;
+	sqlite3_stmt *m_deleteMap = NULL;
+	sqlite3_stmt *m_setMetadata = NULL;
+};
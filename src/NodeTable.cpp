@@ -0,0 +1,30 @@
+#include <stdexcept>
+
+#include "NodeTable.h"
+
+constexpr uint16_t NodeTable::NONE;
+
+NodeTable::NodeTable()
+{
+	m_names.emplace_back(); // NONE
+}
+
+uint16_t NodeTable::lookup(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_ids.find(name);
+	if (it != m_ids.end())
+		return it->second;
+	if (m_names.size() >= UINT16_MAX)
+		throw std::runtime_error("Too many different nodes");
+	uint16_t id = m_names.size();
+	m_names.push_back(name);
+	m_ids.emplace(name, id);
+	return id;
+}
+
+std::string NodeTable::getName(uint16_t id) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_names.at(id);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Assigns dense IDs to node names, so that nodes can be looked up by array
+ * index instead of hashing their name. Can be shared between threads.
+ */
+class NodeTable
+{
+public:
+	static constexpr uint16_t NONE = 0; // air, ignore and invalid nodes
+
+	NodeTable();
+
+	// returns the ID of a node, allocating a new one if needed
+	uint16_t lookup(const std::string &name);
+	std::string getName(uint16_t id) const;
+
+private:
+	mutable std::mutex m_mutex;
+	std::unordered_map<std::string, uint16_t> m_ids;
+	std::vector<std::string> m_names;
+};
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <climits>
+#include <cassert>
+
+#include "Palette.h"
+
+namespace {
+
+struct Entry {
+	u8 c[3];
+	size_t count;
+};
+
+// a range of entries that becomes one palette color
+struct Box {
+	size_t begin, end;
+	size_t weight; // sum of counts
+	int channel, range; // channel with the largest range
+};
+
+Box makeBox(const std::vector<Entry> &entries, size_t begin, size_t end)
+{
+	Box box{begin, end, 0, 0, 0};
+	u8 lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+	for (size_t i = begin; i < end; i++) {
+		box.weight += entries[i].count;
+		for (int k = 0; k < 3; k++) {
+			lo[k] = std::min(lo[k], entries[i].c[k]);
+			hi[k] = std::max(hi[k], entries[i].c[k]);
+		}
+	}
+	for (int k = 0; k < 3; k++) {
+		if (hi[k] - lo[k] > box.range) {
+			box.range = hi[k] - lo[k];
+			box.channel = k;
+		}
+	}
+	return box;
+}
+
+}
+
+std::vector<Color> reduceColors(const ColorCounts &colors, size_t count)
+{
+	assert(count > 0);
+	std::vector<Entry> entries;
+	entries.reserve(colors.size());
+	for (const auto &it : colors) {
+		Entry e;
+		e.c[0] = it.first >> 16;
+		e.c[1] = it.first >> 8;
+		e.c[2] = it.first;
+		e.count = std::max<size_t>(it.second, 1);
+		entries.push_back(e);
+	}
+	// same result no matter how the map was ordered
+	std::sort(entries.begin(), entries.end(), [] (const Entry &a, const Entry &b) {
+		return std::lexicographical_compare(a.c, a.c + 3, b.c, b.c + 3);
+	});
+
+	std::vector<Color> result;
+	if (entries.size() <= count) {
+		for (const auto &e : entries)
+			result.emplace_back(e.c[0], e.c[1], e.c[2]);
+		return result;
+	}
+
+	std::vector<Box> boxes;
+	boxes.push_back(makeBox(entries, 0, entries.size()));
+	while (boxes.size() < count) {
+		// split the box that covers the most pixels over the widest range
+		size_t best = SIZE_MAX;
+		double bestScore = 0;
+		for (size_t i = 0; i < boxes.size(); i++) {
+			const double score = static_cast<double>(boxes[i].range) * boxes[i].weight;
+			if (boxes[i].end - boxes[i].begin > 1 && score > bestScore) {
+				best = i;
+				bestScore = score;
+			}
+		}
+		if (best == SIZE_MAX)
+			break;
+
+		const Box box = boxes[best];
+		const int k = box.channel;
+		std::sort(entries.begin() + box.begin, entries.begin() + box.end,
+			[k] (const Entry &a, const Entry &b) { return a.c[k] < b.c[k]; });
+		// weighted median, both halves get at least one entry
+		size_t mid = box.begin + 1, sum = entries[box.begin].count;
+		while (mid < box.end - 1 && sum + entries[mid].count <= box.weight / 2)
+			sum += entries[mid++].count;
+		boxes[best] = makeBox(entries, box.begin, mid);
+		boxes.push_back(makeBox(entries, mid, box.end));
+	}
+
+	// each box becomes the weighted average of its colors
+	for (const auto &box : boxes) {
+		double sum[3] = {0, 0, 0};
+		for (size_t i = box.begin; i < box.end; i++) {
+			for (int k = 0; k < 3; k++)
+				sum[k] += static_cast<double>(entries[i].c[k]) * entries[i].count;
+		}
+		u8 c[3];
+		for (int k = 0; k < 3; k++)
+			c[k] = static_cast<u8>(sum[k] / box.weight + 0.5);
+		result.emplace_back(c[0], c[1], c[2]);
+	}
+	return result;
+}
+
+Palette::Palette(const std::vector<Color> &colors) :
+	m_colors(colors), m_lastKey(UINT32_MAX), m_lastIndex(0)
+{
+	assert(!m_colors.empty() && m_colors.size() <= 256);
+}
+
+u8 Palette::nearest(uint32_t key)
+{
+	const int r = (key >> 16) & 0xff, g = (key >> 8) & 0xff, b = key & 0xff;
+	u8 best = 0;
+	int bestDist = INT_MAX;
+	for (size_t i = 0; i < m_colors.size(); i++) {
+		const Color &c = m_colors[i];
+		const int dr = c.r - r, dg = c.g - g, db = c.b - b;
+		// weighted like the eye perceives differences
+		const int dist = 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+		if (dist < bestDist) {
+			bestDist = dist;
+			best = i;
+			if (dist == 0)
+				break;
+		}
+	}
+	m_cache.emplace(key, best);
+	return best;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include "Image.h"
+
+// how often each color (as colorKey()) occurs
+typedef std::unordered_map<uint32_t, size_t> ColorCounts;
+
+// 0xRRGGBB
+inline uint32_t colorKey(const Color &c)
+{
+	return (c.r << 16) | (c.g << 8) | c.b;
+}
+
+/*
+ * Reduces colors to at most count using median cut, the most common ones
+ * weigh the most. If there aren't more colors than that they are kept as-is.
+ */
+std::vector<Color> reduceColors(const ColorCounts &colors, size_t count);
+
+/*
+ * Maps colors to the index of the nearest palette entry (alpha is ignored).
+ * Results are remembered, so this is fast if few distinct colors come up.
+ */
+class Palette {
+public:
+	explicit Palette(const std::vector<Color> &colors);
+
+	const std::vector<Color> &colors() const { return m_colors; }
+
+	u8 index(const Color &c)
+	{
+		const uint32_t key = colorKey(c);
+		if (key == m_lastKey)
+			return m_lastIndex;
+		auto it = m_cache.find(key);
+		m_lastIndex = it != m_cache.end() ? it->second : nearest(key);
+		m_lastKey = key;
+		return m_lastIndex;
+	}
+
+private:
+	u8 nearest(uint32_t key);
+
+	std::vector<Color> m_colors;
+	std::unordered_map<uint32_t, u8> m_cache;
+	uint32_t m_lastKey;
+	u8 m_lastIndex;
+};
@@ -1,14 +1,24 @@
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 
 #include "PixelAttributes.h"
 
 PixelAttributes::PixelAttributes():
-	m_width(0)
+	m_heights(nullptr),
+	m_thicknesses(nullptr),
+	m_width(0),
+	m_first(0),
+	m_generation(1)
 {
-	for (size_t i = 0; i < LineCount; ++i) {
-		m_pixelAttributes[i] = nullptr;
-	}
+	for (size_t i = 0; i < LineCount; ++i)
+		m_lineGen[i] = 0;
+}
+
+PixelAttributes::PixelAttributes(const PixelAttributes &other):
+	PixelAttributes()
+{
+	*this = other;
 }
 
 PixelAttributes::~PixelAttributes()
@@ -16,32 +26,76 @@ PixelAttributes::~PixelAttributes()
 	freeAttributes();
 }
 
+PixelAttributes &PixelAttributes::operator=(const PixelAttributes &other)
+{
+	if (this == &other)
+		return *this;
+	freeAttributes();
+	m_width = other.m_width;
+	m_first = other.m_first;
+	m_generation = other.m_generation;
+	memcpy(m_lineGen, other.m_lineGen, sizeof(m_lineGen));
+	if (!other.m_heights)
+		return *this;
+	const size_t size = LineCount * m_width;
+	m_heights = new int16_t[size];
+	m_thicknesses = new uint8_t[size];
+	memcpy(m_heights, other.m_heights, size * sizeof(int16_t));
+	memcpy(m_thicknesses, other.m_thicknesses, size);
+	return *this;
+}
+
 void PixelAttributes::setWidth(int width)
 {
 	freeAttributes();
 	assert(width >= 0);
 	m_width = width + 1; // 1px gradient calculation
-	for (size_t i = 0; i < LineCount; ++i) {
-		m_pixelAttributes[i] = new PixelAttribute[m_width];
-	}
+	m_heights = new int16_t[LineCount * m_width];
+	m_thicknesses = new uint8_t[LineCount * m_width];
+	// clear right away, so that threads can fill different parts of a line
+	for (int i = 0; i < LineCount; ++i)
+		clearLine(i);
 }
 
 void PixelAttributes::scroll()
 {
-	size_t lineLength = m_width * sizeof(PixelAttribute);
-	memcpy(m_pixelAttributes[FirstLine], m_pixelAttributes[LastLine], lineLength);
-	for (size_t i = 1; i < LineCount - 1; ++i) {
-		memcpy(m_pixelAttributes[i], m_pixelAttributes[EmptyLine], lineLength);
+	// the last line becomes line -1, all others are empty
+	const int last = slot(BLOCK_SIZE - 1);
+	const bool lastEmpty = m_lineGen[last] != m_generation;
+	m_first = last;
+	m_generation++;
+	if (!lastEmpty)
+		m_lineGen[last] = m_generation;
+}
+
+void PixelAttributes::copyLine(int z, const PixelAttributes &other, int otherZ)
+{
+	assert(m_width == other.m_width);
+	const int i = slot(z);
+	if (other.empty(otherZ)) {
+		m_lineGen[i] = m_generation - 1;
+		return;
 	}
+	const int j = other.slot(otherZ);
+	memcpy(&m_heights[i * m_width], &other.m_heights[j * m_width],
+		m_width * sizeof(int16_t));
+	memcpy(&m_thicknesses[i * m_width], &other.m_thicknesses[j * m_width],
+		m_width);
+	m_lineGen[i] = m_generation;
 }
 
 void PixelAttributes::freeAttributes()
 {
-	for (size_t i = 0; i < LineCount; ++i) {
-		if (m_pixelAttributes[i] != nullptr) {
-			delete[] m_pixelAttributes[i];
-			m_pixelAttributes[i] = nullptr;
-		}
-	}
+	delete[] m_heights;
+	m_heights = nullptr;
+	delete[] m_thicknesses;
+	m_thicknesses = nullptr;
 }
 
+void PixelAttributes::clearLine(int i)
+{
+	std::fill(&m_heights[i * m_width], &m_heights[(i + 1) * m_width],
+		static_cast<int16_t>(NO_HEIGHT));
+	memset(&m_thicknesses[i * m_width], 0, m_width);
+	m_lineGen[i] = m_generation;
+}
@@ -5,40 +5,68 @@
 
 #define BLOCK_SIZE 16
 
-struct PixelAttribute {
-	PixelAttribute() : height(INT16_MIN), thickness(0) {};
-
-	int16_t height;
-	uint8_t thickness;
-
-	inline bool valid_height() const {
-		return height != INT16_MIN;
-	}
-};
-
+/*
+ * Height and thickness of the pixels of a row of blocks, plus the last line
+ * of the previous row. Heights and thicknesses are stored in separate arrays
+ * so that whole lines can be processed at once (see shadeLine()).
+ * The lines form a ring buffer: scrolling and clearing lines is done by
+ * moving the start and bumping a generation counter, lines are only really
+ * cleared once they are written to again. Therefore after scroll() only one
+ * thread may write to an instance.
+ */
 class PixelAttributes
 {
 public:
+	enum : int16_t {
+		NO_HEIGHT = INT16_MIN,
+	};
+
 	PixelAttributes();
+	PixelAttributes(const PixelAttributes &other);
 	virtual ~PixelAttributes();
 
+	PixelAttributes &operator=(const PixelAttributes &other);
+
 	void setWidth(int width);
 	void scroll();
+	// Copies line otherZ of another instance to line z
+	// (-1 is the first line = last line of the previous row)
+	void copyLine(int z, const PixelAttributes &other, int otherZ);
+	void freeAttributes();
 
-	inline PixelAttribute &attribute(int z, int x) {
-		return m_pixelAttributes[z + 1][x + 1];
-	};
+	// line z was not written to since it was cleared (all heights are unset)
+	inline bool empty(int z) const {
+		return m_lineGen[slot(z)] != m_generation;
+	}
 
-private:
-	void freeAttributes();
+	// line z starting at x = 0, x = -1 is valid too
+	inline int16_t *heights(int z) {
+		const int i = slot(z);
+		if (m_lineGen[i] != m_generation)
+			clearLine(i);
+		return &m_heights[i * m_width + 1];
+	}
+	inline uint8_t *thicknesses(int z) {
+		const int i = slot(z);
+		if (m_lineGen[i] != m_generation)
+			clearLine(i);
+		return &m_thicknesses[i * m_width + 1];
+	}
 
 private:
-	enum Line {
-		FirstLine = 0,
-		LastLine = BLOCK_SIZE,
-		EmptyLine = BLOCK_SIZE + 1,
-		LineCount = BLOCK_SIZE + 2
+	enum {
+		LineCount = BLOCK_SIZE + 1
 	};
-	PixelAttribute *m_pixelAttributes[BLOCK_SIZE + 2]; // 1px gradient + empty
-	int m_width;
+	inline int slot(int z) const {
+		return (m_first + z + 1) % LineCount;
+	}
+	void clearLine(int i);
+
+	int16_t *m_heights; // LineCount lines of m_width each
+	uint8_t *m_thicknesses;
+	int m_width; // 1px gradient + width
+	int m_first; // slot of line -1
+	// a line's content is only valid if its generation is the current one
+	unsigned int m_lineGen[LineCount];
+	unsigned int m_generation;
 };
@@ -0,0 +1,488 @@
+#include <climits>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <cassert>
+#include <algorithm>
+
+#include "PngWriter.h"
+#include "Image.h"
+#include "util.h"
+#include "config.h"
+
+// for convenient usage of both
+#if USE_ZLIB_NG
+#include <zlib-ng.h>
+#define z_stream zng_stream
+#define Z(x) zng_ ## x
+#else
+#include <zlib.h>
+#define Z(x) x
+#endif
+
+// compressed data is written in chunks of about this size
+static constexpr size_t IDAT_SIZE = 256 * 1024;
+// with threads, the image is compressed in parts of about this size
+static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+// size of the deflate window
+static constexpr size_t WINDOW_SIZE = 32 * 1024;
+struct PngWriter::Stream {
+	z_stream zs;
+};
+
+static inline void putU32(u8 *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline u8 paeth(int a, int b, int c)
+{
+	const int p = a + b - c;
+	const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// the filtered value of one byte, given the bytes to the left, above and above left
+template<int Type>
+static inline u8 filterByte(u8 x, int a, int b, int c)
+{
+	if (Type == PNG_FILTER_SUB)
+		return x - a;
+	if (Type == PNG_FILTER_UP)
+		return x - b;
+	if (Type == PNG_FILTER_AVERAGE)
+		return x - (a + b) / 2;
+	if (Type == PNG_FILTER_PAETH)
+		return x - paeth(a, b, c);
+	return x;
+}
+
+// applies a filter type to a row and returns how well it may compress
+template<int Type, int Bpp>
+static unsigned long filter(const u8 *cur, const u8 *prev, size_t n, u8 *out)
+{
+	unsigned long sum = 0;
+	auto add = [&] (size_t i, u8 v) {
+		out[i] = v;
+		sum += v < 128 ? v : 256 - v;
+	};
+	// the first pixel has nothing to its left
+	for (size_t i = 0; i < Bpp && i < n; i++)
+		add(i, filterByte<Type>(cur[i], 0, prev[i], 0));
+	for (size_t i = Bpp; i < n; i++)
+		add(i, filterByte<Type>(cur[i], cur[i - Bpp], prev[i], prev[i - Bpp]));
+	return sum;
+}
+
+template<int Bpp>
+static unsigned long filter(int type, const u8 *cur, const u8 *prev, size_t n, u8 *out)
+{
+	switch (type) {
+		case PNG_FILTER_SUB:
+			return filter<PNG_FILTER_SUB, Bpp>(cur, prev, n, out);
+		case PNG_FILTER_UP:
+			return filter<PNG_FILTER_UP, Bpp>(cur, prev, n, out);
+		case PNG_FILTER_AVERAGE:
+			return filter<PNG_FILTER_AVERAGE, Bpp>(cur, prev, n, out);
+		case PNG_FILTER_PAETH:
+			return filter<PNG_FILTER_PAETH, Bpp>(cur, prev, n, out);
+		default:
+			return filter<PNG_FILTER_NONE, Bpp>(cur, prev, n, out);
+	}
+}
+
+// bpp is the number of bytes per pixel, 3 for RGB or 1 for palette indices
+static unsigned long filter(int type, int bpp, const u8 *cur, const u8 *prev,
+	size_t n, u8 *out)
+{
+	if (bpp == 1)
+		return filter<1>(type, cur, prev, n, out);
+	return filter<3>(type, cur, prev, n, out);
+}
+
+/*
+ * Filters a row of n bytes into out, which gets the filter type followed by
+ * the data. tmp needs as much space as out.
+ */
+static void filterRow(int type, int bpp, const u8 *cur, const u8 *prev, size_t n,
+	u8 *out, u8 *tmp)
+{
+	if (type != PNG_FILTER_ADAPTIVE) {
+		out[0] = type;
+		filter(type, bpp, cur, prev, n, out + 1);
+		return;
+	}
+	if (memcmp(cur, prev, n) == 0) {
+		// happens a lot with zoom, "up" turns it into zeros
+		out[0] = PNG_FILTER_UP;
+		memset(out + 1, 0, n);
+		return;
+	}
+
+	/*
+	 * Try every filter and keep the one whose output has the smallest sum of
+	 * absolute values (taken as signed bytes), like libpng does.
+	 */
+	u8 *buf[2] = {out, tmp};
+	int best = 0;
+	unsigned long bestSum = ULONG_MAX;
+	for (int t = PNG_FILTER_NONE; t <= PNG_FILTER_PAETH; t++) {
+		const int i = bestSum == ULONG_MAX ? 0 : 1 - best;
+		buf[i][0] = t;
+		const unsigned long sum = filter(t, bpp, cur, prev, n, buf[i] + 1);
+		if (sum < bestSum) {
+			bestSum = sum;
+			best = i;
+		}
+	}
+	if (best != 0)
+		memcpy(out, tmp, n + 1);
+}
+
+PngWriter::PngWriter(const std::string &filename, int width, int height,
+	int level, int filter, int threads, const std::vector<Color> &palette) :
+	PngWriter(open_output(filename), nullptr, width, height, level, filter,
+		threads, palette)
+{
+}
+
+PngWriter::PngWriter(ustring *out, int width, int height,
+	int level, int filter, int threads, const std::vector<Color> &palette) :
+	PngWriter(nullptr, out, width, height, level, filter, threads, palette)
+{
+}
+
+PngWriter::PngWriter(FILE *file, ustring *memory, int width, int height,
+	int level, int filter, int threads, const std::vector<Color> &palette) :
+	m_file(file), m_ownFile(file && file != stdout), m_memory(memory),
+	m_width(width), m_height(height), m_rows(0),
+	m_level(level), m_filter(filter), m_bpp(palette.empty() ? 3 : 1),
+	m_bytes(0),
+	m_stream(nullptr),
+	m_chunkRows(0), m_contextRows(0),
+	m_submitted(0), m_written(0),
+	m_adler(0),
+	m_chunks(std::max(threads, 1))
+{
+
+	if (!palette.empty())
+		m_palette.reset(new Palette(palette));
+
+	const size_t rowSize = m_width * m_bpp;
+	m_row.resize(rowSize);
+	m_prevRow.resize(rowSize); // the row above the first one is all zero
+	m_filtered.resize(1 + rowSize);
+	m_candidate.resize(1 + rowSize);
+
+	// before there's anything that needs the destructor to clean up
+	try {
+		writeHeader();
+	} catch (...) {
+		if (m_ownFile)
+			fclose(m_file);
+		throw;
+	}
+
+	// threads only help if there is more than one chunk
+	m_chunkRows = std::max<size_t>(CHUNK_SIZE / rowSize, 1);
+	const size_t chunks = (m_height + m_chunkRows - 1) / m_chunkRows;
+	const size_t nthreads = std::min<size_t>(threads, chunks);
+
+	if (nthreads <= 1) {
+		m_stream = new Stream();
+		z_stream &zs = m_stream->zs;
+		zs.zalloc = Z_NULL;
+		zs.zfree = Z_NULL;
+		zs.opaque = Z_NULL;
+		if (Z(deflateInit)(&zs, m_level) != Z_OK) {
+			delete m_stream;
+			if (m_ownFile)
+				fclose(m_file);
+			throw std::runtime_error("Could not initialize zlib");
+		}
+	} else {
+		m_contextRows = (WINDOW_SIZE + rowSize) / (rowSize + 1);
+		m_chunk.rows = m_prevRow;
+		m_chunk.context = 0;
+		m_adler = Z(adler32)(0, Z_NULL, 0);
+
+		// zlib header, the level is only informational
+		const int level = m_level < 0 ? 6 : m_level;
+		const u8 cmf = 0x78; // deflate, 32K window
+		u8 flg = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+		flg += 31 - (cmf * 256 + flg) % 31;
+		m_out.push_back(cmf);
+		m_out.push_back(flg);
+
+		for (size_t i = 0; i < nthreads; i++) {
+			m_threads.emplace_back([this] () {
+				Chunk chunk;
+				while (m_chunks.pop(chunk)) {
+					Result result;
+					try {
+						compressChunk(chunk, result);
+					} catch (...) {
+						std::lock_guard<std::mutex> lock(m_mutex);
+						if (!m_error)
+							m_error = std::current_exception();
+						m_chunks.close();
+						m_cond.notify_all();
+						return;
+					}
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_results.emplace(chunk.seq, std::move(result));
+					m_cond.notify_all();
+				}
+			});
+		}
+	}
+}
+
+PngWriter::~PngWriter()
+{
+	stopThreads();
+	if (m_stream) {
+		Z(deflateEnd)(&m_stream->zs);
+		delete m_stream;
+	}
+	if (m_ownFile)
+		fclose(m_file);
+}
+
+void PngWriter::stopThreads()
+{
+	m_chunks.close();
+	for (auto &t : m_threads)
+		t.join();
+	m_threads.clear();
+}
+
+void PngWriter::writeHeader()
+{
+	static const u8 signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+	write(signature, sizeof(signature));
+
+	u8 ihdr[13];
+	putU32(ihdr, m_width);
+	putU32(ihdr + 4, m_height);
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = m_palette ? 3 : 2; // indexed or truecolor
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // not interlaced
+	writeChunk("IHDR", ihdr, sizeof(ihdr));
+
+	if (m_palette) {
+		ustring plte;
+		for (const auto &c : m_palette->colors()) {
+			plte.push_back(c.r);
+			plte.push_back(c.g);
+			plte.push_back(c.b);
+		}
+		writeChunk("PLTE", plte.data(), plte.size());
+	}
+}
+
+void PngWriter::writeRow(const Color *row)
+{
+	assert(m_rows < m_height);
+	if (m_palette) {
+		for (int x = 0; x < m_width; x++)
+			m_row[x] = m_palette->index(row[x]);
+	} else {
+		for (int x = 0; x < m_width; x++) {
+			m_row[x * 3] = row[x].r;
+			m_row[x * 3 + 1] = row[x].g;
+			m_row[x * 3 + 2] = row[x].b;
+		}
+	}
+	m_rows++;
+
+	if (!m_stream) {
+		m_chunk.rows += m_row;
+		if (m_chunk.rows.size() / m_row.size() == 1 + m_chunk.context + m_chunkRows)
+			submitChunk(false);
+		return;
+	}
+	filterRow(m_filter, m_bpp, m_row.data(), m_prevRow.data(), m_row.size(),
+		&m_filtered[0], &m_candidate[0]);
+	compress(m_filtered.data(), m_filtered.size(), false);
+	m_row.swap(m_prevRow);
+}
+
+void PngWriter::compress(const u8 *data, size_t size, bool last)
+{
+	// output space is extended in steps of this size
+	constexpr size_t BUFSIZE = 16 * 1024;
+
+	z_stream &zs = m_stream->zs;
+	zs.next_in = const_cast<u8*>(data);
+	zs.avail_in = size;
+	int ret;
+	do {
+		const size_t off = m_out.size();
+		m_out.resize(off + BUFSIZE);
+		zs.next_out = &m_out[off];
+		zs.avail_out = BUFSIZE;
+		ret = Z(deflate)(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR)
+			throw std::runtime_error("Error compressing image");
+		m_out.resize(off + BUFSIZE - zs.avail_out);
+		if (m_out.size() >= IDAT_SIZE) {
+			writeChunk("IDAT", m_out.data(), m_out.size());
+			m_out.clear();
+		}
+	} while (zs.avail_in > 0 || zs.avail_out == 0 || (last && ret != Z_STREAM_END));
+}
+
+void PngWriter::submitChunk(bool last)
+{
+	// the next chunk starts with the last rows of this one
+	const size_t rowSize = m_row.size();
+	const size_t total = m_chunk.rows.size() / rowSize;
+	const size_t keep = std::min(m_contextRows + 1, total);
+	Chunk next;
+	next.rows.assign(m_chunk.rows, (total - keep) * rowSize, keep * rowSize);
+	next.context = keep - 1;
+
+	m_chunk.seq = m_submitted++;
+	m_chunk.last = last;
+	// don't let the threads get too far ahead of the output
+	writeResults(2 * m_threads.size());
+	if (!m_chunks.push(std::move(m_chunk)))
+		writeResults(0); // throws the error that closed the queue
+	m_chunk = std::move(next);
+}
+
+void PngWriter::compressChunk(const Chunk &chunk, Result &result) const
+{
+	const size_t rowSize = m_row.size();
+	const size_t total = chunk.rows.size() / rowSize;
+	ustring filtered((total - 1) * (rowSize + 1), 0);
+	ustring tmp(rowSize + 1, 0);
+	for (size_t r = 1; r < total; r++) {
+		filterRow(m_filter, m_bpp, &chunk.rows[r * rowSize], &chunk.rows[(r - 1) * rowSize],
+			rowSize, &filtered[(r - 1) * (rowSize + 1)], &tmp[0]);
+	}
+	// the context rows were compressed by the chunk before, they are the dictionary
+	const size_t context = chunk.context * (rowSize + 1);
+	u8 *data = &filtered[context];
+	const size_t size = filtered.size() - context;
+
+	z_stream zs;
+	zs.zalloc = Z_NULL;
+	zs.zfree = Z_NULL;
+	zs.opaque = Z_NULL;
+	// raw deflate, the zlib header and checksum are written separately
+	if (Z(deflateInit2)(&zs, m_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("Could not initialize zlib");
+	const size_t dict = std::min(context, WINDOW_SIZE);
+	if (dict > 0)
+		Z(deflateSetDictionary)(&zs, data - dict, dict);
+
+	// all but the last chunk end on a byte boundary without ending the stream
+	const int flush = chunk.last ? Z_FINISH : Z_SYNC_FLUSH;
+	result.data.resize(Z(deflateBound)(&zs, size) + 16);
+	zs.next_in = data;
+	zs.avail_in = size;
+	zs.next_out = &result.data[0];
+	zs.avail_out = result.data.size();
+	int ret;
+	while (true) {
+		ret = Z(deflate)(&zs, flush);
+		if (ret == Z_STREAM_ERROR)
+			break;
+		if (chunk.last ? ret == Z_STREAM_END : zs.avail_out > 0)
+			break;
+		const size_t off = result.data.size() - zs.avail_out;
+		result.data.resize(result.data.size() * 2);
+		zs.next_out = &result.data[off];
+		zs.avail_out = result.data.size() - off;
+	}
+	result.data.resize(result.data.size() - zs.avail_out);
+	Z(deflateEnd)(&zs);
+	if (ret == Z_STREAM_ERROR)
+		throw std::runtime_error("Error compressing image");
+
+	result.adler = Z(adler32)(Z(adler32)(0, Z_NULL, 0), data, size);
+	result.size = size;
+}
+
+void PngWriter::writeResults(size_t max)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		if (m_error)
+			std::rethrow_exception(m_error);
+		auto it = m_results.find(m_written);
+		if (it == m_results.end()) {
+			if (m_submitted - m_written <= max)
+				return;
+			m_cond.wait(lock);
+			continue;
+		}
+		Result result = std::move(it->second);
+		m_results.erase(it);
+		m_written++;
+		lock.unlock();
+
+		m_adler = Z(adler32_combine)(m_adler, result.adler, result.size);
+		m_out += result.data;
+		if (m_out.size() >= IDAT_SIZE) {
+			writeChunk("IDAT", m_out.data(), m_out.size());
+			m_out.clear();
+		}
+		lock.lock();
+	}
+}
+
+void PngWriter::finish()
+{
+	assert(m_rows == m_height);
+	if (m_stream) {
+		compress(nullptr, 0, true);
+	} else {
+		submitChunk(true);
+		writeResults(0);
+		stopThreads();
+		u8 adler[4];
+		putU32(adler, m_adler);
+		m_out.append(adler, 4);
+	}
+	if (!m_out.empty())
+		writeChunk("IDAT", m_out.data(), m_out.size());
+	m_out.clear();
+	writeChunk("IEND", nullptr, 0);
+	if (m_file && fflush(m_file) != 0)
+		throw std::runtime_error("Error saving image");
+}
+
+void PngWriter::writeChunk(const char *type, const u8 *data, size_t size)
+{
+	u8 buf[8];
+	putU32(buf, size);
+	memcpy(buf + 4, type, 4);
+	write(buf, 8);
+	if (size > 0)
+		write(data, size);
+
+	uint32_t crc = Z(crc32)(0, reinterpret_cast<const u8*>(type), 4);
+	if (size > 0)
+		crc = Z(crc32)(crc, data, size);
+	putU32(buf, crc);
+	write(buf, 4);
+}
+
+void PngWriter::write(const void *data, size_t size)
+{
+	if (m_memory)
+		m_memory->append(static_cast<const u8*>(data), size);
+	else if (fwrite(data, 1, size, m_file) != size)
+		throw std::runtime_error("Error saving image");
+	m_bytes += size;
+}
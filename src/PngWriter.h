@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include "BoundedQueue.h"
+#include "Encoder.h"
+#include "Palette.h"
+#include "types.h"
+
+/*
+ * Writes a PNG image one row at a time, so the whole image never needs to be
+ * in memory. Like gd does for truecolor images the alpha channel is dropped.
+ * With a palette the image is written with 8-bit indices into it instead.
+ * More than one thread compresses parts of the image in parallel.
+ */
+class PngWriter : public Encoder {
+public:
+	/*
+	 * "-" writes to stdout. level is a zlib level, -1 for its default.
+	 * palette has at most 256 colors, empty for a truecolor image.
+	 */
+	PngWriter(const std::string &filename, int width, int height,
+		int level, int filter, int threads, const std::vector<Color> &palette);
+	// same, but the file is appended to out
+	PngWriter(ustring *out, int width, int height,
+		int level, int filter, int threads, const std::vector<Color> &palette);
+	~PngWriter();
+
+	PngWriter(const PngWriter&) = delete;
+	PngWriter& operator=(const PngWriter&) = delete;
+
+	void writeRow(const Color *row) override;
+	void finish() override;
+	size_t bytesWritten() const override { return m_bytes; }
+	bool buffered() const override { return false; }
+
+private:
+	struct Stream;
+
+	// one of file and memory is set
+	PngWriter(FILE *file, ustring *memory, int width, int height,
+		int level, int filter, int threads, const std::vector<Color> &palette);
+
+	/*
+	 * With threads the image is split into chunks of rows that are filtered
+	 * and compressed independently, then put together into one zlib stream
+	 * (like pigz does). Each chunk starts with the rows before it, which
+	 * are only used as dictionary so little compression is lost.
+	 */
+	struct Chunk {
+		size_t seq = 0;
+		bool last = false;
+		size_t context = 0; // number of rows used as dictionary
+		ustring rows; // unfiltered, starts with the row above the context rows
+	};
+	struct Result {
+		ustring data;
+		unsigned long adler = 0, size = 0; // of the uncompressed data
+	};
+
+	void compress(const u8 *data, size_t size, bool last);
+	void submitChunk(bool last);
+	void compressChunk(const Chunk &chunk, Result &result) const;
+	// writes finished chunks in order, waiting until at most max are left
+	void writeResults(size_t max);
+	void stopThreads();
+	// signature, IHDR and PLTE
+	void writeHeader();
+	void writeChunk(const char *type, const u8 *data, size_t size);
+	void write(const void *data, size_t size);
+
+	FILE *m_file;
+	bool m_ownFile;
+	ustring *m_memory;
+	int m_width, m_height, m_rows;
+	int m_level, m_filter;
+	int m_bpp; // bytes per pixel
+	std::unique_ptr<Palette> m_palette;
+	size_t m_bytes;
+	ustring m_row, m_prevRow; // unfiltered
+	ustring m_filtered, m_candidate; // filter type followed by the row
+	ustring m_out; // compressed data not written yet
+
+	// without threads: everything goes through one stream
+	Stream *m_stream;
+
+	// with threads
+	size_t m_chunkRows, m_contextRows;
+	Chunk m_chunk;
+	size_t m_submitted, m_written;
+	unsigned long m_adler;
+	std::vector<std::thread> m_threads;
+	BoundedQueue<Chunk> m_chunks;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::map<size_t, Result> m_results;
+	std::exception_ptr m_error;
+};
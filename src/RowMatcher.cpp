@@ -0,0 +1,97 @@
+#include <cstring>
+
+#include "RowMatcher.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if HAVE_SSE2 && defined(__GNUC__)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if !HAVE_SSE2
+static uint16_t match_scalar(const unsigned char *row, const uint16_t *values, int count)
+{
+	uint16_t ret = 0;
+	for (int x = 0; x < 16; x++) {
+		uint16_t v;
+		memcpy(&v, &row[x * 2], 2);
+		for (int i = 0; i < count; i++) {
+			if (v == values[i])
+				ret |= 1 << x;
+		}
+	}
+	return ret;
+}
+#endif
+
+#if HAVE_SSE2
+static uint16_t match_sse2(const unsigned char *row, const uint16_t *values, int count)
+{
+	const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row));
+	const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + 16));
+	__m128i ma = _mm_setzero_si128(), mb = _mm_setzero_si128();
+	for (int i = 0; i < count; i++) {
+		const __m128i v = _mm_set1_epi16(values[i]);
+		ma = _mm_or_si128(ma, _mm_cmpeq_epi16(a, v));
+		mb = _mm_or_si128(mb, _mm_cmpeq_epi16(b, v));
+	}
+	return _mm_movemask_epi8(_mm_packs_epi16(ma, mb));
+}
+#endif
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static uint16_t match_avx2(const unsigned char *row, const uint16_t *values, int count)
+{
+	const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row));
+	__m256i m = _mm256_setzero_si256();
+	for (int i = 0; i < count; i++)
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi16(a, _mm256_set1_epi16(values[i])));
+	// packing works within each 128-bit lane, so nodes 0-7 end up in
+	// bits 0-7 and nodes 8-15 in bits 16-23
+	uint32_t bits = _mm256_movemask_epi8(_mm256_packs_epi16(m, m));
+	return (bits & 0xff) | ((bits >> 8) & 0xff00);
+}
+#endif
+
+RowMatcher::MatchFunc RowMatcher::pickImplementation()
+{
+#if HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return match_avx2;
+#endif
+#if HAVE_SSE2
+	return match_sse2;
+#else
+	return match_scalar;
+#endif
+}
+
+const RowMatcher::MatchFunc RowMatcher::s_match = RowMatcher::pickImplementation();
+
+bool RowMatcher::add(uint16_t value)
+{
+	if (m_count == MAX_VALUES)
+		return false;
+	// convert from big endian to the byte order in memory
+	const unsigned char bytes[2] = { (unsigned char) (value >> 8), (unsigned char) value };
+	memcpy(&m_values[m_count++], bytes, 2);
+	return true;
+}
+
+const char *RowMatcher::implementation()
+{
+#if HAVE_AVX2
+	if (s_match == match_avx2)
+		return "AVX2";
+#endif
+#if HAVE_SSE2
+	if (s_match == match_sse2)
+		return "SSE2";
+#endif
+	return "scalar";
+}
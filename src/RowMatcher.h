@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Finds the nodes in a row of 16 content IDs (as stored in the map data,
+ * i.e. big endian) that have one of a few given IDs.
+ * Uses SSE2 or AVX2 where available.
+ */
+class RowMatcher
+{
+public:
+	enum { MAX_VALUES = 8 };
+
+	RowMatcher() : m_count(0) {}
+
+	// returns false if there are too many values
+	bool add(uint16_t value);
+	// bit x of the result is set if node x matches
+	inline uint16_t match(const unsigned char *row) const {
+		return s_match(row, m_values, m_count);
+	}
+
+	static const char *implementation();
+
+private:
+	typedef uint16_t (*MatchFunc)(const unsigned char *row,
+		const uint16_t *values, int count);
+	static MatchFunc pickImplementation();
+	static const MatchFunc s_match;
+
+	uint16_t m_values[MAX_VALUES]; // in the same byte order as the data
+	int m_count;
+};
@@ -0,0 +1,143 @@
+#include <algorithm>
+
+#include "Shading.h"
+#include "PixelAttributes.h"
+#include "Image.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// attenuation for each thickness value, computed like it always was
+struct ThicknessTable {
+	float factor[256];
+
+	ThicknessTable() {
+		for (int i = 0; i < 256; i++) {
+			float t = i * 1.2f;
+			t = std::min(t, 255.0f);
+			factor[i] = 1.0f - t / 255.0f;
+		}
+	}
+};
+
+const ThicknessTable thicknessTable;
+
+inline u8 addClamped(u8 c, int d)
+{
+	return std::min(std::max(c + d, 0), 255);
+}
+
+inline void shadePixel(Color *pixels, int x, const int16_t *heights,
+	const int16_t *heightsAbove, const uint8_t *thickness)
+{
+	const int16_t y = heights[x], y1 = heights[x - 1], y2 = heightsAbove[x];
+	if (y == PixelAttributes::NO_HEIGHT || y1 == PixelAttributes::NO_HEIGHT ||
+		y2 == PixelAttributes::NO_HEIGHT)
+		return;
+
+	int d = ((y - y1) + (y - y2)) * 12;
+	if (thickness) // less visible shadow with increasing "thickness"
+		d *= thicknessTable.factor[thickness[x]];
+	d = std::min(d, 36);
+
+	// apply shadow/light by just adding to it pixel values
+	Color &c = pixels[x];
+	c.r = addClamped(c.r, d);
+	c.g = addClamped(c.g, d);
+	c.b = addClamped(c.b, d);
+}
+
+#if HAVE_SSE2
+// returns (a > b) ? b : a for 32-bit integers
+inline __m128i min_epi32(__m128i a, __m128i b)
+{
+	const __m128i gt = _mm_cmpgt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
+
+// sign-extends 4 16-bit integers to 32 bits
+inline __m128i extend_lo(__m128i v)
+{
+	return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+inline __m128i extend_hi(__m128i v)
+{
+	return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+
+// attenuates 4 values of d by the thickness of the respective pixels
+inline __m128i attenuate(__m128i d, const uint8_t *thickness)
+{
+	const float *f = thicknessTable.factor;
+	const __m128 factor = _mm_setr_ps(f[thickness[0]], f[thickness[1]],
+		f[thickness[2]], f[thickness[3]]);
+	// exact: |d| is far below 2^24
+	return _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(d), factor));
+}
+
+void shadeEight(Color *pixels, const int16_t *heights,
+	const int16_t *heightsAbove, const uint8_t *thickness)
+{
+	const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(heights));
+	const __m128i y1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(heights - 1));
+	const __m128i y2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(heightsAbove));
+
+	const __m128i none = _mm_set1_epi16(PixelAttributes::NO_HEIGHT);
+	const __m128i invalid = _mm_or_si128(_mm_cmpeq_epi16(y, none),
+		_mm_or_si128(_mm_cmpeq_epi16(y1, none), _mm_cmpeq_epi16(y2, none)));
+	if (_mm_movemask_epi8(invalid) == 0xffff)
+		return;
+
+	// d = ((y - y1) + (y - y2)) * 12, which needs 32 bits
+	__m128i d[2];
+	for (int i = 0; i < 2; i++) {
+		__m128i a = i ? extend_hi(y) : extend_lo(y);
+		__m128i b = i ? extend_hi(y1) : extend_lo(y1);
+		__m128i c = i ? extend_hi(y2) : extend_lo(y2);
+		__m128i v = _mm_sub_epi32(_mm_add_epi32(a, a), _mm_add_epi32(b, c));
+		v = _mm_add_epi32(_mm_slli_epi32(v, 3), _mm_slli_epi32(v, 2));
+		if (thickness)
+			v = attenuate(v, thickness + i * 4);
+		d[i] = min_epi32(v, _mm_set1_epi32(36));
+	}
+	// anything below -255 gives the same result, so 16 bits are enough now
+	__m128i d16 = _mm_packs_epi32(d[0], d[1]);
+	d16 = _mm_max_epi16(d16, _mm_set1_epi16(-255));
+	d16 = _mm_andnot_si128(invalid, d16);
+
+	// two pixels per 128 bits after widening to 16 bits per channel
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0); // keep alpha
+	__m128i *p = reinterpret_cast<__m128i*>(pixels);
+	for (int i = 0; i < 2; i++) {
+		// d of pixels 4i to 4i+3, each twice
+		const __m128i dd = i ? _mm_unpackhi_epi16(d16, d16) : _mm_unpacklo_epi16(d16, d16);
+		const __m128i d01 = _mm_and_si128(_mm_unpacklo_epi32(dd, dd), rgb);
+		const __m128i d23 = _mm_and_si128(_mm_unpackhi_epi32(dd, dd), rgb);
+		const __m128i in = _mm_loadu_si128(p + i);
+		const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(in, zero), d01);
+		const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(in, zero), d23);
+		_mm_storeu_si128(p + i, _mm_packus_epi16(lo, hi)); // clamps to 0-255
+	}
+}
+#endif
+
+}
+
+void shadeLine(Color *pixels, int width, const int16_t *heights,
+	const int16_t *heightsAbove, const uint8_t *thickness)
+{
+	int x = 0;
+#if HAVE_SSE2
+	for (; x + 8 <= width; x += 8) {
+		shadeEight(pixels + x, heights + x, heightsAbove + x,
+			thickness ? thickness + x : nullptr);
+	}
+#endif
+	for (; x < width; x++)
+		shadePixel(pixels, x, heights, heightsAbove, thickness);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+struct Color;
+
+/*
+ * Shades a line of pixels by comparing each height with the pixel to the
+ * left and the one above. Pixels without all three heights are left alone.
+ * heights[-1] must be valid. thickness may be nullptr, otherwise the shading
+ * becomes weaker with increasing thickness (for --drawalpha).
+ * Uses SSE2 where available.
+ */
+void shadeLine(Color *pixels, int width, const int16_t *heights,
+	const int16_t *heightsAbove, const uint8_t *thickness);
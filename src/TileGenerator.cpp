@@ -10,12 +10,23 @@
 #include <vector>
 #include <type_traits>
 #include <limits>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <condition_variable>
 
 #include "TileGenerator.h"
 #include "config.h"
 #include "PlayerAttributes.h"
 #include "BlockDecoder.h"
+#include "BoundedQueue.h"
+#include "RowMatcher.h"
+#include "Shading.h"
 #include "Image.h"
+#include "Encoder.h"
+#include "Palette.h"
+#include "TileWriter.h"
 #include "util.h"
 #include "log.h"
 
@@ -90,11 +101,6 @@ static constexpr int16_t mod16(int16_t y)
 	return y / 16;
 }
 
-static constexpr unsigned int colorSafeBounds(int channel)
-{
-	return mymin(mymax(channel, 0), 255);
-}
-
 static Color parseColor(const std::string &color)
 {
 	if (color.length() != 7)
@@ -109,17 +115,16 @@ static Color parseColor(const std::string &color)
 	return Color(r, g, b);
 }
 
-static Color mixColors(Color a, Color b)
+// Puts the color of a node below the color accumulated so far. This used
+// to be done in floating point, which came out 1 lower in rare cases.
+static inline Color mixColors(const Color &a, const ColorEntry &b)
 {
+	const int wa = a.a * 255, wb = 255 - a.a;
 	Color result;
-	float a1 = a.a / 255.0f;
-	float a2 = b.a / 255.0f;
-
-	result.r = (int) (a1 * a.r + a2 * (1 - a1) * b.r);
-	result.g = (int) (a1 * a.g + a2 * (1 - a1) * b.g);
-	result.b = (int) (a1 * a.b + a2 * (1 - a1) * b.b);
-	result.a = (int) (255 * (a1 + a2 * (1 - a1)));
-
+	result.r = (wa * a.r + wb * b.pr) / (255 * 255);
+	result.g = (wa * a.g + wb * b.pg) / (255 * 255);
+	result.b = (wa * a.b + wb * b.pb) / (255 * 255);
+	result.a = (wa + wb * b.a) / 255;
 	return result;
 }
 
@@ -138,6 +143,8 @@ TileGenerator::TileGenerator():
 	m_yBorder(0),
 	m_db(nullptr),
 	m_image(nullptr),
+	m_imageWidth(0),
+	m_imageHeight(0),
 	m_xMin(INT_MAX),
 	m_xMax(INT_MIN),
 	m_zMin(INT_MAX),
@@ -152,6 +159,15 @@ TileGenerator::TileGenerator():
 	m_renderedAny(false),
 	m_zoom(1),
 	m_scales(SCALE_LEFT | SCALE_TOP),
+	m_threads(1),
+	m_threadMode(THREADS_AUTO),
+	m_blockCache(true),
+	m_stream(false),
+	m_tiles(false),
+	m_encoder(nullptr),
+	m_streamStdout(false),
+	m_streamRow(0),
+	m_streamLine(0),
 	m_progressMax(0),
 	m_progressLast(-1)
 {
@@ -160,6 +176,8 @@ TileGenerator::TileGenerator():
 TileGenerator::~TileGenerator()
 {
 	closeDatabase();
+	delete m_encoder;
+	m_encoder = nullptr;
 	delete m_image;
 	m_image = nullptr;
 }
@@ -259,6 +277,53 @@ void TileGenerator::setDontWriteEmpty(bool f)
 	m_dontWriteEmpty = f;
 }
 
+void TileGenerator::setThreads(int n)
+{
+	if (n < 1)
+		throw std::runtime_error("Number of threads needs to be 1 or higher");
+	m_threads = n;
+}
+
+void TileGenerator::setThreadMode(int mode)
+{
+	m_threadMode = mode;
+}
+
+void TileGenerator::setBlockCache(bool enabled)
+{
+	m_blockCache = enabled;
+}
+
+void TileGenerator::setStreaming(bool enabled)
+{
+	m_stream = enabled;
+}
+
+void TileGenerator::setTiles(bool enabled)
+{
+	// tiles are cut while rendering
+	m_tiles = enabled;
+	if (enabled)
+		m_stream = true;
+}
+
+void TileGenerator::setEncoder(int encoder)
+{
+	m_encoderOptions.encoder = encoder;
+}
+
+void TileGenerator::setPngLevel(int level)
+{
+	if (level < 0 || level > 9)
+		throw std::runtime_error("PNG compression level needs to be a number from 0 to 9");
+	m_encoderOptions.level = level;
+}
+
+void TileGenerator::setPngFilter(int filter)
+{
+	m_encoderOptions.filter = filter;
+}
+
 void TileGenerator::parseColorsFile(const std::string &fileName)
 {
 	std::ifstream in(fileName);
@@ -303,6 +368,14 @@ void TileGenerator::dumpBlock(const std::string &input_path, BlockPos pos)
 
 void TileGenerator::generate(const std::string &input_path, const std::string &output)
 {
+	if (m_stream && (m_drawScale || m_drawOrigin || m_drawPlayers))
+		throw std::runtime_error("--stream and --tiles can not be combined with "
+			"--drawscale, --draworigin or --drawplayers");
+	if (m_tiles && output == "-")
+		throw std::runtime_error("Tiles can not be written to stdout");
+	if (output == "-" && pickEncoder(m_encoderOptions, output) == ENCODER_GD)
+		throw std::runtime_error("The gd encoder can not write to stdout");
+
 	openDb(input_path);
 	loadBlocks();
 
@@ -315,15 +388,25 @@ void TileGenerator::generate(const std::string &input_path, const std::string &o
 	}
 
 	createImage();
+	if (m_stream)
+		startStream(output);
 	renderMap();
 
 	if (m_dontWriteEmpty && !m_renderedAny) {
 		verbosestream << "Result is empty (no pixels)" << std::endl;
+		if (m_encoder)
+			abortStream(output);
 		printUnknown();
 		return;
 	}
 
 	closeDatabase();
+	if (m_encoder) {
+		finishStream();
+		printUnknown();
+		return;
+	}
+	scaleImage();
 	if (m_drawScale) {
 		renderScale();
 	}
@@ -377,6 +460,25 @@ std::set<std::string> TileGenerator::getSupportedBackends()
 	return r;
 }
 
+static DB *createDatabase(const std::string &backend, const std::string &input)
+{
+	if (backend == "sqlite3")
+		return new DBSQLite3(input);
+#if USE_POSTGRESQL
+	if (backend == "postgresql")
+		return new DBPostgreSQL(input);
+#endif
+#if USE_LEVELDB
+	if (backend == "leveldb")
+		return new DBLevelDB(input);
+#endif
+#if USE_REDIS
+	if (backend == "redis")
+		return new DBRedis(input);
+#endif
+	throw std::runtime_error(std::string("Unknown map backend: ") + backend);
+}
+
 void TileGenerator::openDb(const std::string &input_path)
 {
 	if (dir_exists(input_path.c_str())) {
@@ -400,25 +502,11 @@ void TileGenerator::openDb(const std::string &input_path)
 		backend = read_setting_default("backend", ifs, "sqlite3");
 	}
 
-	if (backend == "dummy") {
+	if (backend == "dummy")
 		throw std::runtime_error("This map uses the dummy backend and contains no data");
-	} else if (backend == "sqlite3") {
-		m_db = new DBSQLite3(input);
-#if USE_POSTGRESQL
-	} else if (backend == "postgresql") {
-		m_db = new DBPostgreSQL(input);
-#endif
-#if USE_LEVELDB
-	} else if (backend == "leveldb") {
-		m_db = new DBLevelDB(input);
-#endif
-#if USE_REDIS
-	} else if (backend == "redis") {
-		m_db = new DBRedis(input);
-#endif
-	} else {
-		throw std::runtime_error(std::string("Unknown map backend: ") + backend);
-	}
+	m_db = createDatabase(backend, input);
+	m_dbPath = input;
+	m_dbBackend = backend;
 
 	if (!read_setting_default("readonly_backend", ifs, "").empty()) {
 		errorstream << "Warning: Maps with readonly_backend are not supported. "
@@ -477,7 +565,8 @@ void TileGenerator::loadBlocks()
 			m_zMin = mymin<int>(m_zMin, pos.z);
 			m_zMax = mymax<int>(m_zMax, pos.z);
 
-			m_positions[pos.z].emplace(pos.x);
+			// some backends list every block, others only the columns
+			m_positions[pos.z][pos.x]++;
 		}
 
 		size_t count = 0;
@@ -516,7 +605,6 @@ void TileGenerator::createImage()
 
 	m_mapWidth = (m_xMax - m_xMin + 1) * 16;
 	m_mapHeight = (m_zMax - m_zMin + 1) * 16;
-	m_blockPixelAttributes.setWidth(m_mapWidth);
 
 	m_xBorder = (m_scales & SCALE_LEFT) ? scale_d : 0;
 	m_yBorder = (m_scales & SCALE_TOP) ? scale_d : 0;
@@ -527,267 +615,1031 @@ void TileGenerator::createImage()
 	image_height = (m_mapHeight * m_zoom) + m_yBorder;
 	image_height += (m_scales & SCALE_BOTTOM) ? scale_d : 0;
 
-	if(image_width > 4096 || image_height > 4096) {
+	// with --stream only a few rows are in memory at a time
+	if (!m_stream && (image_width > 4096 || image_height > 4096)) {
 		errorstream << "Warning: The side length of the image to be created exceeds 4096 pixels!"
 			<< " (dimensions: " << image_width << "x" << image_height << ")"
-			<< std::endl;
+			<< " Consider --stream." << std::endl;
 	} else {
 		verbosestream << "Creating image with size " << image_width << "x" << image_height
 			<< std::endl;
 	}
-	m_image = new Image(image_width, image_height);
-	m_image->drawFilledRect(0, 0, image_width, image_height, m_bgColor); // Background
+	m_imageWidth = image_width;
+	m_imageHeight = image_height;
+
+	// zoom and borders are added afterwards, see scaleImage()
+	m_image = new Image(m_mapWidth, m_mapHeight);
+	m_image->drawFilledRect(0, 0, m_mapWidth, m_mapHeight, m_bgColor); // Background
+}
+
+void TileGenerator::scaleImage()
+{
+	if (m_imageWidth == m_mapWidth && m_imageHeight == m_mapHeight)
+		return; // nothing to do
+
+	Image *image = new Image(m_imageWidth, m_imageHeight);
+	image->drawFilledRect(0, 0, m_imageWidth, m_imageHeight, m_bgColor); // Background
+	image->drawScaled(*m_image, m_xBorder, m_yBorder, m_zoom);
+	delete m_image;
+	m_image = image;
+}
+
+void TileGenerator::startStream(const std::string &output)
+{
+	// there are no borders, so the image is just the zoomed map
+	assert(m_imageWidth == m_mapWidth * m_zoom && m_imageHeight == m_mapHeight * m_zoom);
+	EncoderOptions options = m_encoderOptions;
+	options.threads = m_threads;
+	if (pickEncoder(options, output) == ENCODER_PALETTE)
+		options.palette = buildPalette(false);
+	if (m_tiles) {
+		TileWriter *tiles = new TileWriter(output, m_imageWidth, m_imageHeight,
+			options, m_bgColor);
+		verbosestream << "Writing tiles for zoom levels 0 to " << tiles->maxZoom()
+			<< std::endl;
+		m_encoder = tiles;
+	} else {
+		m_encoder = createEncoder(options, output, m_imageWidth, m_imageHeight);
+	}
+	if (m_encoder->buffered()) {
+		errorstream << "Warning: The image is kept in memory anyway with this encoder"
+			<< std::endl;
+	} else if (m_threads > 1 && m_threadMode == THREADS_BANDS) {
+		errorstream << "Warning: Bands are kept in memory until those above them are done"
+			<< std::endl;
+	}
+	m_streamStdout = output == "-";
+	m_streamBuffer.resize(m_mapWidth + m_imageWidth);
+	m_encodeTime = std::chrono::steady_clock::duration::zero();
+	verbosestream << "Writing image while rendering" << std::endl;
+}
+
+void TileGenerator::finishRow(size_t index, int16_t zPos)
+{
+	if (!m_encoder)
+		return;
+
+	/* Rows can finish in any order with threads but are written in order:
+	 * once a row and all rows before it are finished, their lines are
+	 * written, including those of the Z positions without blocks between. */
+	std::lock_guard<std::mutex> lock(m_streamMutex);
+	m_rowEnd[index] = (m_zMax - zPos) * 16 + 16;
+	while (m_streamRow < m_rowEnd.size() && m_rowEnd[m_streamRow] != -1)
+		writeLines(m_rowEnd[m_streamRow++]);
+	m_image->discardRows(m_streamLine);
+}
+
+void TileGenerator::writeLines(int end)
+{
+	const auto start = std::chrono::steady_clock::now();
+	Color *line = &m_streamBuffer[0], *zoomed = &m_streamBuffer[m_mapWidth];
+	for (; m_streamLine < mymin(end, m_mapHeight); m_streamLine++) {
+		m_image->readRow(m_streamLine, line);
+		if (m_zoom == 1) {
+			m_encoder->writeRow(line);
+			continue;
+		}
+		for (int x = 0; x < m_mapWidth; x++) {
+			for (int i = 0; i < m_zoom; i++)
+				zoomed[x * m_zoom + i] = line[x];
+		}
+		for (int i = 0; i < m_zoom; i++)
+			m_encoder->writeRow(zoomed);
+	}
+	m_encodeTime += std::chrono::steady_clock::now() - start;
+}
+
+void TileGenerator::finishStream()
+{
+	writeLines(m_mapHeight);
+	const auto start = std::chrono::steady_clock::now();
+	m_encoder->finish();
+	m_encodeTime += std::chrono::steady_clock::now() - start;
+	reportEncoding(m_encoder->bytesWritten(), m_encodeTime);
+	verbosestream << "Kept at most " << m_image->peakTiles() << " of "
+		<< m_image->tileCount() << " image tiles in memory" << std::endl;
+	delete m_encoder;
+	m_encoder = nullptr;
+	delete m_image;
+	m_image = nullptr;
+}
+
+void TileGenerator::abortStream(const std::string &output)
+{
+	delete m_encoder;
+	m_encoder = nullptr;
+	// tiles written so far are left alone
+	if (output != "-" && !m_tiles)
+		std::remove(output.c_str());
 }
 
 void TileGenerator::renderMap()
 {
-	BlockDecoder blk;
 	const int16_t yMax = mod16(m_yMax) + 1;
 	const int16_t yMin = mod16(m_yMin);
-	size_t bTotal = 0, bRender = 0, bEmpty = 0;
 
-	// returns true to skip
-	auto decode = [&] (BlockPos pos, const ustring &buf) -> bool {
-		blk.reset();
+	// Nodes with a color get the lowest IDs, see renderMapBlock()
+	m_nodeColors.resize(1);
+	for (const auto &it : m_colorMap) {
+		const uint16_t id = m_nodes.lookup(it.first);
+		if (id >= m_nodeColors.size())
+			m_nodeColors.resize(id + 1);
+		m_nodeColors[id] = it.second;
+	}
+
+	// Z rows to render, in order
+	std::vector<int16_t> rows;
+	if (m_exhaustiveSearch == EXH_FULL) {
+		const size_t span_y = yMax - yMin;
+		m_progressMax = (m_geomX2 - m_geomX) * span_y * (m_geomY2 - m_geomY);
+		verbosestream << "Exhaustively searching "
+			<< (m_geomX2 - m_geomX) << "x" << span_y << "x"
+			<< (m_geomY2 - m_geomY) << " blocks" << std::endl;
+		for (int16_t zPos = m_geomY2 - 1; zPos >= m_geomY; zPos--)
+			rows.push_back(zPos);
+	} else {
+		if (m_exhaustiveSearch == EXH_Y) {
+			verbosestream << "Exhaustively searching height of "
+				<< (yMax - yMin) << " blocks" << std::endl;
+		}
+		for (auto it = m_positions.rbegin(); it != m_positions.rend(); ++it)
+			rows.push_back(it->first);
+	}
+
+	if (m_encoder) {
+		m_rowEnd.assign(rows.size(), -1);
+		m_streamRow = 0;
+		m_streamLine = 0;
+	}
+
+	verbosestream << "Filtering nodes with the " << RowMatcher::implementation()
+		<< " row matcher" << std::endl;
+
+	int mode = m_threadMode;
+	std::vector<RenderState> states(1);
+	std::vector<std::unique_ptr<DB>> connections;
+	states[0].db = m_db;
+	if (m_threads > 1 && mode != THREADS_PIPELINE) {
+		// every thread needs its own connection
+		const size_t nthreads = mode == THREADS_BANDS ?
+			mymin<size_t>(m_threads, rows.size()) : m_threads;
 		try {
-			blk.decode(buf);
+			while (connections.size() + 1 < nthreads)
+				connections.emplace_back(createDatabase(m_dbBackend, m_dbPath));
 		} catch (std::exception &e) {
-			errorstream << "While decoding block " << pos.x << ',' << pos.y << ',' << pos.z
-				<< ':' << std::endl;
-			throw;
-		};
-		return blk.isEmpty();
+			if (mode == THREADS_AUTO) {
+				verbosestream << "Could not open additional database connection ("
+					<< e.what() << "), using a pipeline instead" << std::endl;
+				connections.clear();
+				mode = THREADS_PIPELINE;
+			} else {
+				errorstream << "Warning: Could not open additional database connection ("
+					<< e.what() << "), rendering with fewer threads" << std::endl;
+			}
+		}
+		for (auto &db : connections) {
+			states.emplace_back();
+			states.back().db = db.get();
+		}
+	}
+
+	if (m_threads > 1 && mode == THREADS_PIPELINE)
+		renderPipelined(rows, states[0]);
+	else if (states.size() > 1 && mode != THREADS_BANDS)
+		renderColumns(rows, states);
+	else
+		renderBands(rows, states);
+
+	RenderState &total = states[0];
+	for (size_t i = 1; i < states.size(); i++)
+		total.merge(states[i]);
+	m_renderedAny |= total.renderedAny;
+	for (size_t id = 0; id < total.unknownNodes.size(); id++) {
+		if (total.unknownNodes[id])
+			m_unknownNodes.insert(m_nodes.getName(id));
+	}
+
+	reportProgress(m_progressMax);
+	verbosestream << "Block stats: " << total.blocksTotal << " total, "
+		<< total.blocksRendered << " rendered, " << total.blocksEmpty
+		<< " empty, " << total.cache.hits << " cache hits, "
+		<< total.cache.misses << " cache misses" << std::endl;
+}
+
+void RenderState::merge(const RenderState &other)
+{
+	blocksTotal += other.blocksTotal;
+	blocksRendered += other.blocksRendered;
+	blocksEmpty += other.blocksEmpty;
+	cache.hits += other.cache.hits;
+	cache.misses += other.cache.misses;
+	renderedAny |= other.renderedAny;
+	if (unknownNodes.size() < other.unknownNodes.size())
+		unknownNodes.resize(other.unknownNodes.size());
+	for (size_t id = 0; id < other.unknownNodes.size(); id++) {
+		if (other.unknownNodes[id])
+			unknownNodes[id] = true;
+	}
+}
+
+size_t TileGenerator::countColumns(int16_t zPos) const
+{
+	if (m_exhaustiveSearch == EXH_FULL)
+		return m_geomX2 - m_geomX;
+	return m_positions.at(zPos).size();
+}
+
+template<typename F>
+void TileGenerator::forEachColumn(int16_t zPos, F func) const
+{
+	if (m_exhaustiveSearch == EXH_FULL) {
+		for (int16_t xPos = m_geomX2 - 1; xPos >= m_geomX; xPos--)
+			func(xPos, 1);
+	} else {
+		const auto &xs = m_positions.at(zPos);
+		for (auto it = xs.rbegin(); it != xs.rend(); ++it)
+			func(it->first, it->second);
+	}
+}
+
+void TileGenerator::fetchColumn(DB *db, int16_t xPos, int16_t zPos, BlockList &blocks)
+{
+	const int16_t yMax = mod16(m_yMax) + 1;
+	const int16_t yMin = mod16(m_yMin);
+
+	blocks.clear();
+	if (m_exhaustiveSearch == EXH_NEVER) {
+		db->getBlocksOnXZ(blocks, xPos, zPos, yMin, yMax);
+	} else {
+		std::vector<BlockPos> positions;
+		positions.reserve(yMax - yMin);
+		for (int16_t yPos = yMin; yPos < yMax; yPos++)
+			positions.emplace_back(xPos, yPos, zPos);
+		db->getBlocksByPos(blocks, positions);
+	}
+	blocks.sort();
+}
+
+void TileGenerator::renderBands(const std::vector<int16_t> &rows,
+	std::vector<RenderState> &states)
+{
+	// Split the rows into bands with about the same number of columns
+	size_t columns = 0;
+	for (int16_t zPos : rows)
+		columns += countColumns(zPos);
+	std::vector<size_t> bandStart;
+	{
+		size_t sum = 0;
+		for (size_t i = 0; i < rows.size(); i++) {
+			if (bandStart.size() < states.size() &&
+				sum >= columns * bandStart.size() / states.size())
+				bandStart.push_back(i);
+			sum += countColumns(rows[i]);
+		}
+		bandStart.resize(states.size(), rows.size());
+		bandStart.push_back(rows.size());
+	}
+	if (states.size() > 1) {
+		verbosestream << "Rendering " << rows.size() << " rows in "
+			<< states.size() << " bands" << std::endl;
+	}
+	for (auto &st : states)
+		st.attributes.setWidth(m_mapWidth);
+
+	/* The first row of all but the first band can only be shaded once the
+	 * last row of the band before it is known. Whichever of the two bands is
+	 * done with its part last does it, so the row can be written early. */
+	std::mutex boundaryMutex;
+	std::vector<int> boundaryParts(states.size(), 0);
+	auto finishBoundary = [&] (size_t band) {
+		{
+			std::lock_guard<std::mutex> lock(boundaryMutex);
+			if (++boundaryParts[band] < 2)
+				return;
+		}
+		RenderState &st = states[band];
+		st.firstRow.copyLine(-1, states[band - 1].attributes, -1);
+		renderShading(st.firstRow, rows[bandStart[band]]);
+		finishRow(bandStart[band], rows[bandStart[band]]);
 	};
 
-	auto renderSingle = [&] (int16_t xPos, int16_t zPos, BlockList &blockStack) {
-		if (blockStack.empty())
-			return;
+	std::atomic<size_t> count(0); // fraction of m_progressMax
+	auto renderBand = [&] (size_t band) {
+		RenderState &st = states[band];
+		const size_t begin = bandStart[band], end = bandStart[band + 1];
+		BlockDecoder blk(m_nodes);
+		BlockList blockStack;
+
+		for (size_t i = begin; i < end; i++) {
+			const int16_t zPos = rows[i];
+			forEachColumn(zPos, [&] (int16_t xPos, unsigned) {
+				fetchColumn(st.db, xPos, zPos, blockStack);
+				if (renderColumn(st, blk, xPos, zPos, blockStack))
+					drawColumn(st.attributes, st.column);
+				reportProgress(count++);
+			});
 
-		m_readPixels.reset();
-		m_readInfo.reset();
-		for (int i = 0; i < 16; i++) {
-			for (int j = 0; j < 16; j++) {
-				m_color[i][j] = m_bgColor; // This will be drawn by renderMapBlockBottom() for y-rows with only 'air', 'ignore' or unknown nodes if --drawalpha is used
-				m_color[i][j].a = 0; // ..but set alpha to 0 to tell renderMapBlock() not to use this color to mix a shade
-				m_thickness[i][j] = 0;
+			if (!m_shading) {
+				finishRow(i, zPos);
+				continue;
+			}
+			if (i == begin && band > 0) {
+				st.firstRow = st.attributes;
+				finishBoundary(band);
+			} else {
+				renderShading(st.attributes, zPos);
+				finishRow(i, zPos);
 			}
+			st.attributes.scroll();
 		}
+		// bands that are empty are all at the end
+		if (m_shading && band + 1 < states.size() && end != bandStart[band + 2])
+			finishBoundary(band + 1);
+	};
 
-		bTotal += blockStack.size();
-		for (const auto &it : blockStack) {
-			const BlockPos pos = it.first;
-			assert(pos.x == xPos && pos.z == zPos);
-			assert(pos.y >= yMin && pos.y < yMax);
+	if (states.size() == 1) {
+		renderBand(0);
+		return;
+	}
 
-			if (decode(pos, it.second)) {
-				bEmpty++;
-				continue;
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(states.size());
+	for (size_t i = 0; i < states.size(); i++) {
+		threads.emplace_back([&, i] () {
+			try {
+				renderBand(i);
+			} catch (...) {
+				errors[i] = std::current_exception();
 			}
-			bRender++;
-			renderMapBlock(blk, pos);
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+	for (auto &e : errors) {
+		if (e)
+			std::rethrow_exception(e);
+	}
+}
 
-			// Exit out if all pixels for this MapBlock are covered
-			if (m_readPixels.full())
-				break;
-		}
-		if (!m_readPixels.full())
-			renderMapBlockBottom(blockStack.begin()->first);
-		m_renderedAny |= m_readInfo.any();
+void TileGenerator::renderPipelined(const std::vector<int16_t> &rows,
+	RenderState &state)
+{
+	/*
+	 * One thread reads the columns from the database, a pool of threads
+	 * decodes and renders them and the calling thread puts the results into
+	 * the image in order (which is required for shading).
+	 * Columns are identified by their index in the rendering order.
+	 */
+	struct Job {
+		size_t seq;
+		int16_t x, z;
+		BlockList blocks;
 	};
-	auto postRenderRow = [&] (int16_t zPos) {
-		if (m_shading)
-			renderShading(zPos);
+
+	const size_t nworkers = m_threads;
+	const size_t window = 16 * nworkers; // max. number of columns in flight
+	BoundedQueue<Job> jobs(4 * nworkers);
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::map<size_t, ColumnData> results;
+	size_t consumed = 0;
+	std::exception_ptr error;
+	bool aborted = false;
+
+	auto fail = [&] () {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!error)
+			error = std::current_exception();
+		aborted = true;
+		jobs.close();
+		cond.notify_all();
 	};
 
-	size_t count = 0; // fraction of m_progressMax
-	if (m_exhaustiveSearch == EXH_NEVER) {
-		for (auto it = m_positions.rbegin(); it != m_positions.rend(); ++it) {
-			int16_t zPos = it->first;
-			for (auto it2 = it->second.rbegin(); it2 != it->second.rend(); ++it2) {
-				int16_t xPos = *it2;
+	verbosestream << "Rendering with a pipeline of " << nworkers
+		<< " threads" << std::endl;
+	state.attributes.setWidth(m_mapWidth);
 
-				BlockList blockStack;
-				m_db->getBlocksOnXZ(blockStack, xPos, zPos, yMin, yMax);
-				blockStack.sort();
+	std::vector<std::thread> threads;
+	threads.emplace_back([&] () {
+		try {
+			size_t seq = 0;
+			for (int16_t zPos : rows) {
+				forEachColumn(zPos, [&] (int16_t xPos, unsigned) {
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						cond.wait(lock, [&] {
+							return aborted || seq - consumed < window;
+						});
+					}
+					Job job{seq++, xPos, zPos, {}};
+					fetchColumn(state.db, xPos, zPos, job.blocks);
+					if (!jobs.push(std::move(job)))
+						throw std::runtime_error("Pipeline aborted");
+				});
+			}
+			jobs.close();
+		} catch (...) {
+			fail();
+		}
+	});
+
+	std::vector<RenderState> workers(nworkers);
+	for (auto &st : workers) {
+		threads.emplace_back([&] () {
+			try {
+				BlockDecoder blk(m_nodes);
+				Job job;
+				while (jobs.pop(job)) {
+					if (!renderColumn(st, blk, job.x, job.z, job.blocks))
+						st.column.readPixels.reset();
+					std::lock_guard<std::mutex> lock(mutex);
+					results.emplace(job.seq, st.column);
+					cond.notify_all();
+				}
+			} catch (...) {
+				fail();
+			}
+		});
+	}
 
-				renderSingle(xPos, zPos, blockStack);
-				reportProgress(count++);
+	auto finish = [&] () {
+		jobs.close();
+		for (auto &t : threads)
+			t.join();
+		for (auto &st : workers)
+			state.merge(st);
+	};
+
+	try {
+		for (size_t row = 0; row < rows.size(); row++) {
+			const int16_t zPos = rows[row];
+			const size_t n = countColumns(zPos);
+			for (size_t i = 0; i < n; i++) {
+				ColumnData col;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cond.wait(lock, [&] {
+						return aborted || results.count(consumed) > 0;
+					});
+					if (aborted)
+						std::rethrow_exception(error);
+					auto it = results.find(consumed);
+					col = it->second;
+					results.erase(it);
+					consumed++;
+					cond.notify_all();
+				}
+				drawColumn(state.attributes, col);
+				reportProgress(consumed);
 			}
-			postRenderRow(zPos);
+			if (m_shading)
+				renderShading(state.attributes, zPos);
+			finishRow(row, zPos);
+			state.attributes.scroll();
 		}
-	} else if (m_exhaustiveSearch == EXH_Y) {
-		verbosestream << "Exhaustively searching height of "
-			<< (yMax - yMin) << " blocks" << std::endl;
-		std::vector<BlockPos> positions;
-		positions.reserve(yMax - yMin);
-		for (auto it = m_positions.rbegin(); it != m_positions.rend(); ++it) {
-			int16_t zPos = it->first;
-			for (auto it2 = it->second.rbegin(); it2 != it->second.rend(); ++it2) {
-				int16_t xPos = *it2;
+	} catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			aborted = true;
+			cond.notify_all();
+		}
+		finish();
+		throw;
+	}
+	finish();
+}
 
-				positions.clear();
-				for (int16_t yPos = yMin; yPos < yMax; yPos++)
-					positions.emplace_back(xPos, yPos, zPos);
+void TileGenerator::renderColumns(const std::vector<int16_t> &rows,
+	std::vector<RenderState> &states)
+{
+	/*
+	 * Every column is a task. Each thread starts with a contiguous range of
+	 * tasks of about the same cost, estimated from the number of blocks the
+	 * backend reported for them. A thread that runs out of work steals the
+	 * upper half of the largest range left.
+	 * Rows are completed in no particular order, so a row is shaded as soon
+	 * as both it and the row before it are complete.
+	 * When streaming, rows can only be written in order. The threads then
+	 * take the columns one after another instead, so the rows that are in
+	 * memory at once stay close together.
+	 */
+	struct Task {
+		int16_t x;
+		uint16_t cost;
+		uint32_t row;
+	};
+	struct Range {
+		std::mutex mutex;
+		size_t begin = 0, end = 0;
+	};
+	struct Row {
+		std::atomic<size_t> remaining; // columns not yet rendered
+		bool allocated = false, done = false, shaded = false;
+		PixelAttributes attributes;
+	};
 
-				BlockList blockStack;
-				m_db->getBlocksByPos(blockStack, positions);
-				blockStack.sort();
+	std::vector<Task> tasks;
+	std::vector<Row> rowState(rows.size());
+	uint64_t totalCost = 0;
+	for (size_t i = 0; i < rows.size(); i++) {
+		size_t n = 0;
+		forEachColumn(rows[i], [&] (int16_t xPos, unsigned blocks) {
+			tasks.push_back(Task{xPos, (uint16_t) blocks, (uint32_t) i});
+			totalCost += blocks;
+			n++;
+		});
+		rowState[i].remaining = n;
+	}
 
-				renderSingle(xPos, zPos, blockStack);
-				reportProgress(count++);
+	const size_t nthreads = states.size();
+	std::vector<Range> ranges(nthreads);
+	{
+		uint64_t sum = 0;
+		size_t k = 0;
+		for (size_t i = 0; i < tasks.size(); i++) {
+			while (k < nthreads && sum >= totalCost * k / nthreads)
+				ranges[k++].begin = i;
+			sum += tasks[i].cost;
+		}
+		for (; k < nthreads; k++)
+			ranges[k].begin = tasks.size();
+		for (k = 0; k < nthreads; k++)
+			ranges[k].end = k + 1 < nthreads ? ranges[k + 1].begin : tasks.size();
+	}
+	const bool inOrder = m_encoder != nullptr;
+	verbosestream << "Rendering " << tasks.size() << " columns with "
+		<< nthreads << " threads" << (inOrder ? " in order" : "") << std::endl;
+
+	std::mutex mutex; // protects the row flags
+	std::atomic<bool> aborted(false);
+	std::atomic<size_t> count(0), steals(0), next(0);
+
+	auto shadeRow = [&] (size_t i) {
+		Row &row = rowState[i];
+		if (i > 0)
+			row.attributes.copyLine(-1, rowState[i - 1].attributes, 15);
+		renderShading(row.attributes, rows[i]);
+		finishRow(i, rows[i]);
+
+		// attributes are needed until the rows on both sides are shaded
+		std::lock_guard<std::mutex> lock(mutex);
+		row.shaded = true;
+		if (i > 0 && rowState[i - 1].shaded)
+			rowState[i - 1].attributes.freeAttributes();
+		if (i + 1 == rows.size() || rowState[i + 1].shaded)
+			row.attributes.freeAttributes();
+	};
+	auto rowDone = [&] (size_t i) {
+		if (!m_shading) {
+			rowState[i].attributes.freeAttributes();
+			finishRow(i, rows[i]);
+			return;
+		}
+		bool shadeThis, shadeNext;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			rowState[i].done = true;
+			shadeThis = i == 0 || rowState[i - 1].done;
+			shadeNext = i + 1 < rows.size() && rowState[i + 1].done;
+		}
+		if (shadeThis)
+			shadeRow(i);
+		if (shadeNext)
+			shadeRow(i + 1);
+	};
+
+	auto nextTask = [&] (size_t self, size_t &index) -> bool {
+		if (inOrder) {
+			index = next++;
+			return index < tasks.size();
+		}
+		Range &own = ranges[self];
+		{
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (own.begin < own.end) {
+				index = own.begin++;
+				return true;
 			}
-			postRenderRow(zPos);
 		}
-	} else if (m_exhaustiveSearch == EXH_FULL) {
-		const size_t span_y = yMax - yMin;
-		m_progressMax = (m_geomX2 - m_geomX) * span_y * (m_geomY2 - m_geomY);
-		verbosestream << "Exhaustively searching "
-			<< (m_geomX2 - m_geomX) << "x" << span_y << "x"
-			<< (m_geomY2 - m_geomY) << " blocks" << std::endl;
+		while (!aborted) {
+			size_t victim = nthreads, left = 0;
+			for (size_t i = 0; i < nthreads; i++) {
+				std::lock_guard<std::mutex> lock(ranges[i].mutex);
+				if (ranges[i].end - ranges[i].begin > left) {
+					victim = i;
+					left = ranges[i].end - ranges[i].begin;
+				}
+			}
+			if (victim == nthreads)
+				return false;
+			size_t begin, end;
+			{
+				std::lock_guard<std::mutex> lock(ranges[victim].mutex);
+				Range &r = ranges[victim];
+				if (r.begin == r.end)
+					continue; // someone was faster, try again
+				begin = r.begin + (r.end - r.begin) / 2;
+				end = r.end;
+				r.end = begin;
+			}
+			steals++;
+			std::lock_guard<std::mutex> lock(own.mutex);
+			own.begin = begin + 1;
+			own.end = end;
+			index = begin;
+			return true;
+		}
+		return false;
+	};
 
-		std::vector<BlockPos> positions;
-		positions.reserve(span_y);
-		for (int16_t zPos = m_geomY2 - 1; zPos >= m_geomY; zPos--) {
-			for (int16_t xPos = m_geomX2 - 1; xPos >= m_geomX; xPos--) {
-				positions.clear();
-				for (int16_t yPos = yMin; yPos < yMax; yPos++)
-					positions.emplace_back(xPos, yPos, zPos);
-
-				BlockList blockStack;
-				m_db->getBlocksByPos(blockStack, positions);
-				blockStack.sort();
-
-				renderSingle(xPos, zPos, blockStack);
-				reportProgress(count++);
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(nthreads);
+	for (size_t t = 0; t < nthreads; t++) {
+		threads.emplace_back([&, t] () {
+			RenderState &st = states[t];
+			BlockDecoder blk(m_nodes);
+			BlockList blockStack;
+			size_t index, lastRow = SIZE_MAX;
+			try {
+				while (!aborted && nextTask(t, index)) {
+					const Task &task = tasks[index];
+					Row &row = rowState[task.row];
+					const int16_t zPos = rows[task.row];
+					if (task.row != lastRow) {
+						std::lock_guard<std::mutex> lock(mutex);
+						if (!row.allocated) {
+							row.attributes.setWidth(m_mapWidth);
+							row.allocated = true;
+						}
+						lastRow = task.row;
+					}
+					fetchColumn(st.db, task.x, zPos, blockStack);
+					if (renderColumn(st, blk, task.x, zPos, blockStack))
+						drawColumn(row.attributes, st.column);
+					reportProgress(count++);
+					if (--row.remaining == 0)
+						rowDone(task.row);
+				}
+			} catch (...) {
+				errors[t] = std::current_exception();
+				aborted = true;
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+	for (auto &e : errors) {
+		if (e)
+			std::rethrow_exception(e);
+	}
+	if (!inOrder)
+		verbosestream << "Columns were stolen " << steals << " times" << std::endl;
+}
+
+bool TileGenerator::renderColumn(RenderState &st, BlockDecoder &blk,
+	int16_t xPos, int16_t zPos, const BlockList &blockStack)
+{
+	if (blockStack.empty())
+		return false;
+
+	auto &col = st.column;
+	col.x = xPos;
+	col.z = zPos;
+	col.readPixels.reset();
+	col.readInfo.reset();
+	for (int i = 0; i < 16; i++) {
+		for (int j = 0; j < 16; j++) {
+			col.color[i][j] = m_bgColor; // This will be drawn by renderMapBlockBottom() for y-rows with only 'air', 'ignore' or unknown nodes if --drawalpha is used
+			col.color[i][j].a = 0; // ..but set alpha to 0 to tell renderMapBlock() not to use this color to mix a shade
+			col.thickness[i][j] = 0;
+		}
+	}
+
+	st.blocksTotal += blockStack.size();
+	for (const auto &it : blockStack) {
+		const BlockPos pos = it.first;
+		assert(pos.x == xPos && pos.z == zPos);
+		assert(pos.y >= mod16(m_yMin) && pos.y < mod16(m_yMax) + 1);
+
+		// the cache only knows about the top surface of whole blocks
+		const bool cacheable = m_blockCache && !m_drawAlpha &&
+			pos.y * 16 >= m_yMin && pos.y * 16 + 15 <= m_yMax &&
+			BlockCache::eligible(it.second);
+		const BlockCache::Surface *surface = nullptr;
+		uint64_t hash = 0;
+		if (cacheable) {
+			hash = BlockCache::hash(it.second);
+			surface = st.cache.find(hash, it.second);
+		}
+
+		if (!surface) {
+			blk.reset();
+			try {
+				blk.decode(it.second);
+			} catch (std::exception &e) {
+				errorstream << "While decoding block " << pos.x << ',' << pos.y << ',' << pos.z
+					<< ':' << std::endl;
+				throw;
+			};
+			if (cacheable && st.cache.wants(hash)) {
+				BlockCache::Surface newSurface;
+				if (getBlockSurface(blk, newSurface))
+					st.cache.add(hash, it.second, newSurface);
 			}
-			postRenderRow(zPos);
 		}
+		if (surface ? surface->empty : blk.isEmpty()) {
+			st.blocksEmpty++;
+			continue;
+		}
+		st.blocksRendered++;
+		if (surface)
+			renderBlockSurface(col, *surface, pos);
+		else
+			renderMapBlock(st, blk, pos);
+
+		// Exit out if all pixels for this MapBlock are covered
+		if (col.readPixels.full())
+			break;
 	}
+	if (!col.readPixels.full())
+		renderMapBlockBottom(col);
+	st.renderedAny |= col.readInfo.any();
+	return true;
+}
 
-	reportProgress(m_progressMax);
-	verbosestream << "Block stats: " << bTotal << " total, " << bRender
-		<< " rendered, " << bEmpty << " empty" << std::endl;
+void TileGenerator::drawColumn(PixelAttributes &a, const ColumnData &col)
+{
+	int xBegin = (col.x - m_xMin) * 16;
+	int zBegin = (m_zMax - col.z) * 16;
+	for (int z = 0; z < 16; ++z) {
+		int imageY = zBegin + 15 - z;
+		int16_t *heights = a.heights(15 - z) + xBegin;
+		uint8_t *thicknesses = a.thicknesses(15 - z) + xBegin;
+		for (int x = 0; x < 16; ++x) {
+			if (!col.readPixels.get(x, z))
+				continue;
+			m_image->drawFilledRect(xBegin + x, imageY, 1, 1, col.color[z][x]);
+			thicknesses[x] = col.thickness[z][x];
+			if (col.readInfo.get(x, z))
+				heights[x] = col.height[z][x];
+		}
+	}
 }
 
-void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
+void TileGenerator::renderMapBlock(RenderState &st, const BlockDecoder &blk, const BlockPos &pos)
 {
-	int xBegin = (pos.x - m_xMin) * 16;
-	int zBegin = (m_zMax - pos.z) * 16;
 	int minY = (pos.y * 16 > m_yMin) ? 0 : m_yMin - pos.y * 16;
 	int maxY = (pos.y * 16 + 15 < m_yMax) ? 15 : m_yMax - pos.y * 16;
+
+	if (blk.isUniform()) {
+		renderUniformBlock(st, blk.getUniformNode(), minY, maxY, pos);
+		return;
+	}
+
+	// pick the variant for this block once, instead of checking per node
+	const bool wide = blk.getContentWidth() == 2;
+	if (m_drawAlpha) {
+		if (wide)
+			renderMapBlock<2, true>(st, blk, minY, maxY, pos);
+		else
+			renderMapBlock<1, true>(st, blk, minY, maxY, pos);
+	} else {
+		if (wide)
+			renderMapBlock<2, false>(st, blk, minY, maxY, pos);
+		else
+			renderMapBlock<1, false>(st, blk, minY, maxY, pos);
+	}
+}
+
+template<int ContentWidth, bool DrawAlpha>
+void TileGenerator::renderMapBlock(RenderState &st, const BlockDecoder &blk,
+	int minY, int maxY, const BlockPos &pos)
+{
+	auto &col = st.column;
+
+	// Air and invisible nodes are filtered out a row of 16 nodes at a time,
+	// going down layer by layer until all pixels are done.
+	RowMatcher skip;
+	bool useRows = ContentWidth == 2;
+	if (useRows) {
+		blk.forEachMapping([&] (uint16_t content, uint16_t id) {
+			if (id == NodeTable::NONE ||
+				(id < m_nodeColors.size() && m_nodeColors[id].a == 0))
+				useRows &= skip.add(content);
+		});
+	}
+
+	if (useRows) {
+		for (int y = maxY; y >= minY; --y) {
+			if (col.readPixels.full())
+				break;
+			for (int z = 0; z < 16; ++z) {
+				uint16_t todo = ~col.readPixels.val[z];
+				if (todo == 0)
+					continue;
+				todo &= ~skip.match(blk.getRow(y, z));
+				for (int x = 0; todo != 0; x++, todo >>= 1) {
+					if (todo & 1)
+						renderNode<DrawAlpha>(st, blk.getNode<ContentWidth>(x, y, z), x, z, pos.y * 16 + y);
+				}
+			}
+		}
+		return;
+	}
+
 	for (int z = 0; z < 16; ++z) {
-		int imageY = zBegin + 15 - z;
 		for (int x = 0; x < 16; ++x) {
-			if (m_readPixels.get(x, z))
+			if (col.readPixels.get(x, z))
 				continue;
-			int imageX = xBegin + x;
-			auto &attr = m_blockPixelAttributes.attribute(15 - z, xBegin + x);
 
 			for (int y = maxY; y >= minY; --y) {
-				const std::string &name = blk.getNode(x, y, z);
-				if (name.empty())
-					continue;
-				auto it = m_colorMap.find(name);
-				if (it == m_colorMap.end()) {
-					m_unknownNodes.insert(name);
+				if (renderNode<DrawAlpha>(st, blk.getNode<ContentWidth>(x, y, z), x, z, pos.y * 16 + y))
+					break;
+			}
+		}
+	}
+}
+
+void TileGenerator::renderUniformBlock(RenderState &st, uint16_t id, int minY, int maxY, const BlockPos &pos)
+{
+	auto &col = st.column;
+	if (minY > maxY)
+		return;
+	if (id >= m_nodeColors.size() || m_nodeColors[id].a == 0) {
+		// unknown or invisible: renderNode() only records it, pixels are untouched
+		renderNode<false>(st, id, 0, 0, 0);
+		return;
+	}
+
+	if (!m_drawAlpha) {
+		// the top layer decides all remaining pixels
+		Color c = m_nodeColors[id].toColor();
+		c.a = 255;
+		const int16_t height = pos.y * 16 + maxY;
+		for (int z = 0; z < 16; ++z) {
+			for (int x = 0; x < 16; ++x) {
+				if (col.readPixels.get(x, z))
 					continue;
+				col.color[z][x] = c;
+				col.readPixels.set(x, z);
+				if (!col.readInfo.get(x, z)) {
+					col.height[z][x] = height;
+					col.readInfo.set(x, z);
 				}
+			}
+		}
+		return;
+	}
 
-				Color c = it->second.toColor();
-				if (c.a == 0)
-					continue; // node is fully invisible
-				if (m_drawAlpha) {
-					if (m_color[z][x].a != 0)
-						c = mixColors(m_color[z][x], c);
-					if (c.a < 255) {
-						// remember color and near thickness value
-						m_color[z][x] = c;
-						m_thickness[z][x] = (m_thickness[z][x] + it->second.t) / 2;
-						continue;
-					}
-					// color became opaque, draw it
-					setZoomed(imageX, imageY, c);
-					attr.thickness = m_thickness[z][x];
-				} else {
-					c.a = 255;
-					setZoomed(imageX, imageY, c);
-				}
-				m_readPixels.set(x, z);
+	// with alpha the result depends on what is above, but no node data is needed
+	for (int z = 0; z < 16; ++z) {
+		for (int x = 0; x < 16; ++x) {
+			if (col.readPixels.get(x, z))
+				continue;
+			for (int y = maxY; y >= minY; --y) {
+				if (renderNode<true>(st, id, x, z, pos.y * 16 + y))
+					break;
+			}
+		}
+	}
+}
+
+bool TileGenerator::getBlockSurface(const BlockDecoder &blk, BlockCache::Surface &surface) const
+{
+	surface.empty = blk.isEmpty();
+	if (surface.empty)
+		return true;
+
+	// unknown nodes aren't cached since they need to be reported
+	auto visible = [&] (uint16_t id) {
+		return id != NodeTable::NONE && m_nodeColors[id].a != 0;
+	};
+
+	if (blk.isUniform()) {
+		uint16_t id = blk.getUniformNode();
+		if (id >= m_nodeColors.size())
+			return false;
+		for (int z = 0; z < 16; ++z) {
+			for (int x = 0; x < 16; ++x) {
+				surface.node[z][x] = visible(id) ? id : NodeTable::NONE;
+				surface.y[z][x] = 15;
+			}
+		}
+		return true;
+	}
 
-				// do this afterwards so we can record height values
-				// inside transparent nodes (water) too
-				if (!m_readInfo.get(x, z)) {
-					attr.height = pos.y * 16 + y;
-					m_readInfo.set(x, z);
+	for (int z = 0; z < 16; ++z) {
+		for (int x = 0; x < 16; ++x) {
+			surface.node[z][x] = NodeTable::NONE;
+			for (int y = 15; y >= 0; --y) {
+				uint16_t id = blk.getNode(x, y, z);
+				if (id >= m_nodeColors.size())
+					return false;
+				if (visible(id)) {
+					surface.node[z][x] = id;
+					surface.y[z][x] = y;
+					break;
 				}
-				break;
 			}
 		}
 	}
+	return true;
 }
 
-void TileGenerator::renderMapBlockBottom(const BlockPos &pos)
+void TileGenerator::renderBlockSurface(ColumnData &col, const BlockCache::Surface &surface, const BlockPos &pos)
 {
-	if (!m_drawAlpha)
-		return; // "missing" pixels can only happen with --drawalpha
-
-	int xBegin = (pos.x - m_xMin) * 16;
-	int zBegin = (m_zMax - pos.z) * 16;
+	// same result as renderNode() without --drawalpha
 	for (int z = 0; z < 16; ++z) {
-		int imageY = zBegin + 15 - z;
 		for (int x = 0; x < 16; ++x) {
-			if (m_readPixels.get(x, z))
+			uint16_t id = surface.node[z][x];
+			if (id == NodeTable::NONE || col.readPixels.get(x, z))
 				continue;
-			int imageX = xBegin + x;
-			auto &attr = m_blockPixelAttributes.attribute(15 - z, xBegin + x);
+			Color c = m_nodeColors[id].toColor();
+			c.a = 255;
+			col.color[z][x] = c;
+			col.readPixels.set(x, z);
+			if (!col.readInfo.get(x, z)) {
+				col.height[z][x] = pos.y * 16 + surface.y[z][x];
+				col.readInfo.set(x, z);
+			}
+		}
+	}
+}
+
+template<bool DrawAlpha>
+inline bool TileGenerator::renderNode(RenderState &st, uint16_t id, int x, int z, int height)
+{
+	auto &col = st.column;
+	if (id == NodeTable::NONE)
+		return false;
+	if (id >= m_nodeColors.size()) {
+		if (id >= st.unknownNodes.size())
+			st.unknownNodes.resize(id + 1);
+		st.unknownNodes[id] = true;
+		return false;
+	}
 
-			// set color since it wasn't done in renderMapBlock()
-			setZoomed(imageX, imageY, m_color[z][x]);
-			m_readPixels.set(x, z);
-			attr.thickness = m_thickness[z][x];
+	const ColorEntry &entry = m_nodeColors[id];
+	Color c = entry.toColor();
+	if (c.a == 0)
+		return false; // node is fully invisible
+	if (DrawAlpha) {
+		if (col.color[z][x].a != 0)
+			c = mixColors(col.color[z][x], entry);
+		if (c.a < 255) {
+			// remember color and near thickness value
+			col.color[z][x] = c;
+			col.thickness[z][x] = (col.thickness[z][x] + entry.t) / 2;
+			return false;
 		}
+		// color became opaque, draw it
+	} else {
+		c.a = 255;
+	}
+	col.color[z][x] = c;
+	col.readPixels.set(x, z);
+
+	// do this afterwards so we can record height values
+	// inside transparent nodes (water) too
+	if (!col.readInfo.get(x, z)) {
+		col.height[z][x] = height;
+		col.readInfo.set(x, z);
 	}
+	return true;
 }
 
-void TileGenerator::renderShading(int zPos)
+void TileGenerator::renderMapBlockBottom(ColumnData &col)
+{
+	if (!m_drawAlpha)
+		return; // "missing" pixels can only happen with --drawalpha
+
+	// draw the remaining pixels with the color accumulated so far
+	for (int z = 0; z < 16; ++z)
+		col.readPixels.val[z] = 0xffff;
+}
+
+void TileGenerator::renderShading(PixelAttributes &a, int zPos)
 {
-	auto &a = m_blockPixelAttributes;
 	int zBegin = (m_zMax - zPos) * 16;
 	for (int z = 0; z < 16; ++z) {
 		int imageY = zBegin + z;
 		if (imageY >= m_mapHeight)
 			continue;
-		for (int x = 0; x < m_mapWidth; ++x) {
-			if(
-				!a.attribute(z, x).valid_height() ||
-				!a.attribute(z, x - 1).valid_height() ||
-				!a.attribute(z - 1, x).valid_height()
-			)
-				continue;
-
-			// calculate shadow to apply
-			int y = a.attribute(z, x).height;
-			int y1 = a.attribute(z, x - 1).height;
-			int y2 = a.attribute(z - 1, x).height;
-			int d = ((y - y1) + (y - y2)) * 12;
-
-			if (m_drawAlpha) { // less visible shadow with increasing "thickness"
-				float t = a.attribute(z, x).thickness * 1.2f;
-				t = mymin(t, 255.0f);
-				d *= 1.0f - t / 255.0f;
-			}
-
-			d = mymin(d, 36);
-
-			// apply shadow/light by just adding to it pixel values
-			Color c = m_image->getPixel(getImageX(x), getImageY(imageY));
-			c.r = colorSafeBounds(c.r + d);
-			c.g = colorSafeBounds(c.g + d);
-			c.b = colorSafeBounds(c.b + d);
-			setZoomed(x, imageY, c);
+		// no pixel can have both heights it needs
+		if (a.empty(z) || a.empty(z - 1))
+			continue;
+		const int16_t *heights = a.heights(z), *heightsAbove = a.heights(z - 1);
+		const uint8_t *thicknesses = m_drawAlpha ? a.thicknesses(z) : nullptr;
+		for (int tx = 0; tx * Image::TILE_SIZE < m_mapWidth; tx++) {
+			Color *row = m_image->getTileRow(tx, imageY);
+			if (!row)
+				continue; // nothing drawn there, so nothing to shade
+			const int x = tx * Image::TILE_SIZE;
+			shadeLine(row, std::min(Image::TILE_SIZE, m_mapWidth - x), heights + x,
+				heightsAbove + x, thicknesses ? thicknesses + x : nullptr);
 		}
 	}
-	a.scroll();
 }
 
 void TileGenerator::renderScale()
@@ -886,11 +1738,74 @@ void TileGenerator::renderPlayers(const std::string &input_path)
 
 void TileGenerator::writeImage(const std::string &output)
 {
-	m_image->save(output);
+	EncoderOptions options = m_encoderOptions;
+	options.threads = m_threads;
+	const auto start = std::chrono::steady_clock::now();
+	if (pickEncoder(options, output) == ENCODER_PALETTE)
+		options.palette = buildPalette(true);
+	const size_t bytes = m_image->save(output, options);
+	reportEncoding(bytes, std::chrono::steady_clock::now() - start);
 	delete m_image;
 	m_image = nullptr;
 }
 
+std::vector<Color> TileGenerator::buildPalette(bool fromImage) const
+{
+	ColorCounts counts;
+	if (fromImage) {
+		std::vector<Color> row(m_imageWidth);
+		for (int y = 0; y < m_imageHeight; y++) {
+			m_image->readRow(y, row.data());
+			// count runs of the same color, much faster than every pixel
+			uint32_t key = colorKey(row[0]);
+			size_t run = 0;
+			for (int x = 0; x < m_imageWidth; x++) {
+				const uint32_t k = colorKey(row[x]);
+				if (k != key) {
+					counts[key] += run;
+					key = k;
+					run = 0;
+				}
+				run++;
+			}
+			counts[key] += run;
+		}
+	} else {
+		// every node color lightened and darkened like shading does (darkening
+		// has no limit there, but steep slopes are rare)
+		for (const auto &it : m_colorMap) {
+			const ColorEntry &c = it.second;
+			for (int d = -72; d <= 36; d += 12) {
+				if (d != 0 && !m_shading)
+					continue;
+				auto shade = [d] (int v) { return mymin(mymax(v + d, 0), 255); };
+				counts[colorKey(Color(shade(c.r), shade(c.g), shade(c.b)))] += d == 0 ? 4 : 1;
+			}
+		}
+		// stands for all the empty area
+		counts[colorKey(m_bgColor)] += m_colorMap.size();
+	}
+
+	std::vector<Color> palette = reduceColors(counts, 256);
+	verbosestream << "Palette of " << palette.size() << " colors from "
+		<< counts.size() << " distinct ones" << std::endl;
+	return palette;
+}
+
+void TileGenerator::reportEncoding(size_t bytes, std::chrono::steady_clock::duration time) const
+{
+	const double seconds = std::chrono::duration<double>(time).count();
+	const double pixels = static_cast<double>(m_imageWidth) * m_imageHeight;
+	verbosestream << "Encoded " << m_imageWidth << "x" << m_imageHeight << " image to "
+		<< bytes << " bytes in " << static_cast<int>(seconds * 1000) << " ms";
+	if (seconds > 0) {
+		// RGB input and compressed output
+		verbosestream << " (" << static_cast<int>(pixels * 3 / seconds / 1e6) << " MB/s in, "
+			<< static_cast<int>(bytes / seconds / 1e6) << " MB/s out)";
+	}
+	verbosestream << std::endl;
+}
+
 void TileGenerator::printUnknown()
 {
 	if (m_unknownNodes.empty())
@@ -908,10 +1823,15 @@ void TileGenerator::printUnknown()
 
 void TileGenerator::reportProgress(size_t count)
 {
-	if (!m_progressMax)
+	// stdout might be the image
+	if (!m_progressMax || m_streamStdout)
+		return;
+	// may be called from several threads, whoever gets the lock prints
+	std::unique_lock<std::mutex> lock(m_progressMutex, std::try_to_lock);
+	if (!lock.owns_lock())
 		return;
 	int percent = count / static_cast<float>(m_progressMax) * 100;
-	if (percent == m_progressLast)
+	if (percent <= m_progressLast)
 		return;
 	m_progressLast = percent;
 
@@ -940,8 +1860,3 @@ inline int TileGenerator::getImageY(int val, bool absolute) const
 		val = m_mapHeight - (val - m_zMin * 16); // Z axis is flipped on image
 	return (m_zoom*val) + m_yBorder;
 }
-
-inline void TileGenerator::setZoomed(int x, int y, Color color)
-{
-	m_image->drawFilledRect(getImageX(x), getImageY(y), m_zoom, m_zoom, color);
-}
@@ -6,9 +6,15 @@
 #include <unordered_map>
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
 
 #include "PixelAttributes.h"
+#include "BlockCache.h"
+#include "NodeTable.h"
 #include "Image.h"
+#include "Encoder.h"
 #include "db.h"
 #include "types.h"
 
@@ -29,13 +35,21 @@ enum {
 	EXH_AUTO,  // Automatically pick one of the previous modes
 };
 
+enum {
+	THREADS_AUTO,     // Use columns if possible, otherwise a pipeline
+	THREADS_BANDS,    // Every thread renders a band of rows using its own database connection
+	THREADS_PIPELINE, // One database connection, columns are decoded and rendered in parallel
+	THREADS_COLUMNS,  // Threads take columns from each other as needed, each with its own connection
+};
+
 struct ColorEntry {
-	ColorEntry() : r(0), g(0), b(0), a(0), t(0) {};
+	ColorEntry() : r(0), g(0), b(0), a(0), t(0), pr(0), pg(0), pb(0) {};
 	ColorEntry(uint8_t r, uint8_t g, uint8_t b, uint8_t a, uint8_t t) :
-		r(r), g(g), b(b), a(a), t(t) {};
+		r(r), g(g), b(b), a(a), t(t), pr(r * a), pg(g * a), pb(b * a) {};
 	inline Color toColor() const { return Color(r, g, b, a); }
 	uint8_t r, g, b, a; // Red, Green, Blue, Alpha
 	uint8_t t; // "thickness" value
+	uint16_t pr, pg, pb; // premultiplied with alpha, for blending
 };
 
 struct BitmapThing { // 16x16 bitmap
@@ -62,6 +76,35 @@ struct BitmapThing { // 16x16 bitmap
 	uint16_t val[16];
 };
 
+// Rendered pixels of a single column of blocks (see renderColumn())
+struct ColumnData {
+	int16_t x, z;
+	BitmapThing readPixels; // pixel is done and has a color
+	BitmapThing readInfo; // pixel has a height
+	Color color[16][16];
+	uint8_t thickness[16][16];
+	int16_t height[16][16];
+};
+
+// Everything a thread needs to render its part of the map
+struct RenderState {
+	DB *db = nullptr;
+	PixelAttributes attributes;
+	ColumnData column;
+
+	BlockCache cache;
+	std::vector<bool> unknownNodes; // indexed by node ID
+	bool renderedAny = false;
+	size_t blocksTotal = 0, blocksRendered = 0, blocksEmpty = 0;
+
+	/* copy of the attributes of the first row, used to shade it after the
+	 * previous band has finished (see renderMap()) */
+	PixelAttributes firstRow;
+
+	// adds the results of another state to this one
+	void merge(const RenderState &other);
+};
+
 
 class TileGenerator
 {
@@ -89,6 +132,14 @@ public:
 	void setZoom(int zoom);
 	void setScales(uint flags);
 	void setDontWriteEmpty(bool f);
+	void setThreads(int n);
+	void setThreadMode(int mode);
+	void setBlockCache(bool enabled);
+	void setStreaming(bool enabled);
+	void setTiles(bool enabled);
+	void setEncoder(int encoder);
+	void setPngLevel(int level);
+	void setPngFilter(int filter);
 
 	void generate(const std::string &input, const std::string &output);
 	void printGeometry(const std::string &input);
@@ -103,9 +154,38 @@ private:
 	void loadBlocks();
 	void createImage();
 	void renderMap();
-	void renderMapBlock(const BlockDecoder &blk, const BlockPos &pos);
-	void renderMapBlockBottom(const BlockPos &pos);
-	void renderShading(int zPos);
+	void scaleImage();
+	void startStream(const std::string &output);
+	/*
+	 * For --encoder palette. fromImage uses the colors of the finished image,
+	 * otherwise they are guessed from the color map and shading.
+	 */
+	std::vector<Color> buildPalette(bool fromImage) const;
+	void finishRow(size_t index, int16_t zPos);
+	void writeLines(int end);
+	void finishStream();
+	void abortStream(const std::string &output);
+	void reportEncoding(size_t bytes, std::chrono::steady_clock::duration time) const;
+	size_t countColumns(int16_t zPos) const;
+	template<typename F>
+	void forEachColumn(int16_t zPos, F func) const;
+	void fetchColumn(DB *db, int16_t xPos, int16_t zPos, BlockList &blocks);
+	void renderBands(const std::vector<int16_t> &rows, std::vector<RenderState> &states);
+	void renderPipelined(const std::vector<int16_t> &rows, RenderState &state);
+	void renderColumns(const std::vector<int16_t> &rows, std::vector<RenderState> &states);
+	bool renderColumn(RenderState &st, BlockDecoder &blk, int16_t xPos, int16_t zPos,
+		const BlockList &blockStack);
+	void drawColumn(PixelAttributes &a, const ColumnData &col);
+	void renderMapBlock(RenderState &st, const BlockDecoder &blk, const BlockPos &pos);
+	template<int ContentWidth, bool DrawAlpha>
+	void renderMapBlock(RenderState &st, const BlockDecoder &blk, int minY, int maxY, const BlockPos &pos);
+	void renderUniformBlock(RenderState &st, uint16_t id, int minY, int maxY, const BlockPos &pos);
+	template<bool DrawAlpha>
+	bool renderNode(RenderState &st, uint16_t id, int x, int z, int height);
+	bool getBlockSurface(const BlockDecoder &blk, BlockCache::Surface &surface) const;
+	void renderBlockSurface(ColumnData &col, const BlockCache::Surface &surface, const BlockPos &pos);
+	void renderMapBlockBottom(ColumnData &col);
+	void renderShading(PixelAttributes &a, int zPos);
 	void renderScale();
 	void renderOrigin();
 	void renderPlayers(const std::string &inputPath);
@@ -114,7 +194,6 @@ private:
 	void reportProgress(size_t count);
 	int getImageX(int val, bool absolute=false) const;
 	int getImageY(int val, bool absolute=false) const;
-	void setZoomed(int x, int y, Color color);
 
 private:
 	Color m_bgColor;
@@ -130,9 +209,13 @@ private:
 	std::string m_backend;
 	int m_xBorder, m_yBorder;
 
+	/* world path (with trailing separator) and backend of the open database */
+	std::string m_dbPath;
+	std::string m_dbBackend;
 	DB *m_db;
+	/* contains the map without zoom or borders until scaleImage() is called */
 	Image *m_image;
-	PixelAttributes m_blockPixelAttributes;
+	int m_imageWidth, m_imageHeight; // final size
 	/* smallest/largest seen X or Z block coordinate */
 	int m_xMin;
 	int m_xMax;
@@ -152,16 +235,34 @@ private:
 	int m_exhaustiveSearch;
 	std::set<std::string> m_unknownNodes;
 	bool m_renderedAny;
-	std::map<int16_t, std::set<int16_t>> m_positions; /* indexed by Z, contains X coords */
+	/* indexed by Z, contains X coords and how many blocks the backend reported there */
+	std::map<int16_t, std::map<int16_t, uint16_t>> m_positions;
 	ColorMap m_colorMap;
-	BitmapThing m_readPixels;
-	BitmapThing m_readInfo;
-	Color m_color[16][16];
-	uint8_t m_thickness[16][16];
+	NodeTable m_nodes;
+	/* colors indexed by node ID, higher IDs belong to unknown nodes */
+	std::vector<ColorEntry> m_nodeColors;
 
 	int m_zoom;
 	uint m_scales;
+	int m_threads;
+	int m_threadMode;
+	bool m_blockCache;
+	EncoderOptions m_encoderOptions; // threads are set when writing
+
+	/* with --stream the image is written while rendering, a row at a time
+	 * as soon as all rows before it are finished (see finishRow()) */
+	bool m_stream;
+	bool m_tiles; // output is a directory of tiles, see TileWriter
+	Encoder *m_encoder;
+	bool m_streamStdout;
+	std::mutex m_streamMutex;
+	std::vector<int> m_rowEnd; // image line after each row, -1 if not finished
+	size_t m_streamRow; // next row to write
+	int m_streamLine; // next image line to write
+	std::vector<Color> m_streamBuffer;
+	std::chrono::steady_clock::duration m_encodeTime; // spent in writeLines()
 
 	size_t m_progressMax;
 	int m_progressLast; // percentage
+	std::mutex m_progressMutex;
 }; // class TileGenerator
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <memory>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "TileWriter.h"
+#include "MBTiles.h"
+#include "log.h"
+#include "util.h"
+
+constexpr int TileWriter::TILE_SIZE;
+
+namespace {
+
+/*
+ * XXH64 (https://xxhash.com), fed in pieces. With 64 bits, even a million
+ * distinct tiles have a chance of about 1 in 30 million of two colliding.
+ */
+class Hash64 {
+public:
+	explicit Hash64(uint64_t seed) : m_seed(seed), m_total(0), m_buffered(0)
+	{
+		m_acc[0] = seed + P1 + P2;
+		m_acc[1] = seed + P2;
+		m_acc[2] = seed;
+		m_acc[3] = seed - P1;
+	}
+
+	void update(const void *data, size_t size)
+	{
+		if (size == 0)
+			return; // data may be null
+		const u8 *p = static_cast<const u8*>(data);
+		m_total += size;
+		if (m_buffered + size < sizeof(m_buffer)) {
+			memcpy(m_buffer + m_buffered, p, size);
+			m_buffered += size;
+			return;
+		}
+		if (m_buffered > 0) {
+			const size_t fill = sizeof(m_buffer) - m_buffered;
+			memcpy(m_buffer + m_buffered, p, fill);
+			consume(m_buffer);
+			p += fill;
+			size -= fill;
+			m_buffered = 0;
+		}
+		for (; size >= sizeof(m_buffer); p += sizeof(m_buffer), size -= sizeof(m_buffer))
+			consume(p);
+		memcpy(m_buffer, p, size);
+		m_buffered = size;
+	}
+
+	uint64_t digest() const
+	{
+		uint64_t h;
+		if (m_total >= sizeof(m_buffer)) {
+			h = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) +
+				rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+			for (int i = 0; i < 4; i++)
+				h = (h ^ round(0, m_acc[i])) * P1 + P4;
+		} else {
+			h = m_seed + P5;
+		}
+		h += m_total;
+
+		const u8 *p = m_buffer;
+		size_t size = m_buffered;
+		for (; size >= 8; p += 8, size -= 8)
+			h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		if (size >= 4) {
+			h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+			p += 4;
+			size -= 4;
+		}
+		for (; size > 0; p++, size--)
+			h = rotl(h ^ (*p * P5), 11) * P1;
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL,
+		P3 = 0x165667B19E3779F9ULL, P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+
+	static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+	static uint64_t round(uint64_t acc, uint64_t input)
+	{
+		return rotl(acc + input * P2, 31) * P1;
+	}
+
+	// little endian, so hashes are the same everywhere
+	static uint64_t read64(const u8 *p)
+	{
+		return read32(p) | (read32(p + 4) << 32);
+	}
+	static uint64_t read32(const u8 *p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | (uint64_t(p[3]) << 24);
+	}
+
+	void consume(const u8 *p)
+	{
+		for (int i = 0; i < 4; i++)
+			m_acc[i] = round(m_acc[i], read64(p + i * 8));
+	}
+
+	uint64_t m_seed, m_total;
+	uint64_t m_acc[4];
+	u8 m_buffer[32];
+	size_t m_buffered;
+};
+
+constexpr uint64_t Hash64::P1, Hash64::P2, Hash64::P3, Hash64::P4, Hash64::P5;
+
+/*
+ * Tiles as files in <dir>/<zoom>/<x>/<y>.png. Identical tiles become hard
+ * links to the first one. <dir>/manifest.txt lists the hash of every tile,
+ * for the next run.
+ */
+class DirectoryStore : public TileStore {
+public:
+	DirectoryStore(const std::string &dir, const EncoderOptions &options,
+		uint64_t settings) :
+		m_dir(dir), m_options(options), m_bytes(0), m_manifest(nullptr)
+	{
+		m_extension = options.encoder == ENCODER_RAW ? ".pam" : ".png";
+		create_dir(m_dir);
+		const std::string manifest = m_dir + "/manifest.txt", temp = manifest + ".tmp";
+		readManifest(manifest, settings);
+		/* The new manifest only replaces the old one once all tiles are
+		 * written. If the last run didn't get that far, what it wrote is
+		 * newer and goes into the old one first. */
+		if (file_exists(temp.c_str())) {
+			readManifest(temp, settings);
+			openManifest(temp, settings);
+			for (const auto &it : m_previous)
+				fprintf(m_manifest, "%s %016llx\n", it.first.c_str(),
+					static_cast<unsigned long long>(it.second));
+			for (const auto &name : m_stale)
+				fprintf(m_manifest, "%s\n", name.c_str());
+			closeManifest(temp, manifest);
+		}
+		openManifest(temp, settings);
+	}
+
+	~DirectoryStore()
+	{
+		if (m_manifest)
+			fclose(m_manifest);
+	}
+
+	int reuse(int z, int x, int y, uint64_t hash) override
+	{
+		const std::string name = tileName(z, x, y), path = tilePath(name);
+		auto prev = m_previous.find(name);
+		const bool known = prev != m_previous.end();
+		const bool unchanged = known && prev->second == hash;
+		if (known)
+			m_previous.erase(prev);
+		if (unchanged && file_exists(path.c_str())) {
+			record(name, hash);
+			return TILE_UNCHANGED;
+		}
+		// if we don't get to record the new one, its content is unknown
+		if (known || m_stale.erase(name)) {
+			fprintf(m_manifest, "%s\n", name.c_str());
+			fflush(m_manifest);
+		}
+
+		// it may be linked to other tiles, which must stay as they are
+		std::remove(path.c_str());
+		auto it = m_unique.find(hash);
+		if (it == m_unique.end())
+			return TILE_ENCODE;
+		createDirs(z, x);
+		if (!hard_link(tilePath(it->second), path))
+			return TILE_ENCODE;
+		record(name, hash);
+		return TILE_LINKED;
+	}
+
+	void write(int z, int x, int y, uint64_t hash,
+		const Color *pixels, int stride) override
+	{
+		const std::string name = tileName(z, x, y);
+		createDirs(z, x);
+		std::unique_ptr<Encoder> encoder(createEncoder(m_options, tilePath(name),
+			TileWriter::TILE_SIZE, TileWriter::TILE_SIZE));
+		for (int i = 0; i < TileWriter::TILE_SIZE; i++)
+			encoder->writeRow(&pixels[i * stride]);
+		encoder->finish();
+		m_bytes += encoder->bytesWritten();
+		record(name, hash);
+	}
+
+	size_t finish() override
+	{
+		if (fflush(m_manifest) != 0 || ferror(m_manifest))
+			throw std::runtime_error("Error writing tile manifest");
+		// what's left are tiles outside of the map by now
+		for (const auto &it : m_previous)
+			m_stale.insert(it.first);
+		std::set<std::string> dirs;
+		for (const auto &name : m_stale) {
+			std::remove(tilePath(name).c_str());
+			const size_t slash = name.rfind('/');
+			dirs.insert(name.substr(0, slash));
+			dirs.insert(name.substr(0, name.find('/')));
+		}
+		// "<zoom>/<x>" sort after "<zoom>", so they go first
+		for (auto it = dirs.rbegin(); it != dirs.rend(); ++it)
+			remove_empty_dir(m_dir + "/" + *it);
+		const size_t removed = m_stale.size();
+		m_previous.clear();
+		m_stale.clear();
+
+		const std::string manifest = m_dir + "/manifest.txt";
+		closeManifest(manifest + ".tmp", manifest);
+		return removed;
+	}
+
+	size_t bytesWritten() const override { return m_bytes; }
+
+private:
+	static std::string tileName(int z, int x, int y)
+	{
+		return std::to_string(z) + "/" + std::to_string(x) + "/" + std::to_string(y);
+	}
+
+	std::string tilePath(const std::string &name) const
+	{
+		return m_dir + "/" + name + m_extension;
+	}
+
+	void createDirs(int z, int x)
+	{
+		const std::string dir = std::to_string(z) + "/" + std::to_string(x);
+		if (m_dirs.count(dir))
+			return;
+		create_dir(m_dir + "/" + std::to_string(z));
+		create_dir(m_dir + "/" + dir);
+		m_dirs.insert(dir);
+	}
+
+	void record(const std::string &name, uint64_t hash)
+	{
+		m_unique.emplace(hash, name);
+		fprintf(m_manifest, "%s %016llx\n", name.c_str(),
+			static_cast<unsigned long long>(hash));
+	}
+
+	void openManifest(const std::string &path, uint64_t settings)
+	{
+		m_manifest = fopen(path.c_str(), "w");
+		if (!m_manifest) {
+			throw std::runtime_error("Error opening " + path + ": " +
+				std::strerror(errno));
+		}
+		fprintf(m_manifest, "# minetestmapper tiles %016llx\n",
+			static_cast<unsigned long long>(settings));
+	}
+
+	void closeManifest(const std::string &from, const std::string &path)
+	{
+		const bool failed = ferror(m_manifest);
+		if (fclose(m_manifest) != 0 || failed) {
+			m_manifest = nullptr;
+			throw std::runtime_error("Error writing " + from);
+		}
+		m_manifest = nullptr;
+		replace_file(from, path);
+	}
+
+	// later lines and files replace what was read before
+	void readManifest(const std::string &path, uint64_t settings)
+	{
+		std::ifstream in(path);
+		std::string line;
+		if (!std::getline(in, line))
+			return;
+		unsigned long long previous = 0;
+		const bool same = sscanf(line.c_str(), "# minetestmapper tiles %llx",
+			&previous) == 1 && previous == settings;
+		if (!same) {
+			verbosestream << "Tiles were written with other settings, all will be replaced"
+				<< std::endl;
+		}
+		/* lines are "<zoom>/<x>/<y> <hash>", or just the tile if it was
+		 * being replaced */
+		while (std::getline(in, line)) {
+			int z, x, y, end = 0;
+			unsigned long long hash;
+			if (sscanf(line.c_str(), "%d/%d/%d%n", &z, &x, &y, &end) != 3)
+				continue;
+			// this is what gets deleted, so no other paths
+			const std::string name = tileName(z, x, y);
+			if (same && sscanf(line.c_str() + end, " %llx", &hash) == 1) {
+				m_previous[name] = hash;
+				m_stale.erase(name);
+			} else {
+				m_previous.erase(name);
+				m_stale.insert(name);
+			}
+		}
+	}
+
+	std::string m_dir, m_extension;
+	EncoderOptions m_options;
+	size_t m_bytes;
+	FILE *m_manifest;
+	std::unordered_set<std::string> m_dirs; // "<zoom>/<x>" that exist
+	// from the last run, minus the tiles written since
+	std::unordered_map<std::string, uint64_t> m_previous;
+	std::unordered_set<std::string> m_stale; // the same, but their content is unknown
+	std::unordered_map<uint64_t, std::string> m_unique; // hash -> first tile
+};
+
+}
+
+TileWriter::TileWriter(const std::string &path, int width, int height,
+	const EncoderOptions &options, const Color &background) :
+	m_background(background), m_encoded(0), m_linked(0), m_unchanged(0)
+{
+	EncoderOptions tileOptions = options;
+	// tiles are too small to be worth splitting up
+	tileOptions.threads = 1;
+	if (tileOptions.encoder == ENCODER_AUTO)
+		tileOptions.encoder = ENCODER_PNG;
+
+	// tiles from an earlier run can only be kept if they were encoded the same way
+	const int settings[] = {tileOptions.encoder, tileOptions.level, tileOptions.filter};
+	Hash64 hash(0);
+	hash.update(settings, sizeof(settings));
+	hash.update(tileOptions.palette.data(), tileOptions.palette.size() * sizeof(Color));
+	m_settings = hash.digest();
+
+	int maxZoom = 0;
+	while ((TILE_SIZE << maxZoom) < std::max(width, height))
+		maxZoom++;
+	m_levels.resize(maxZoom + 1);
+
+	for (int z = 0; z <= maxZoom; z++) {
+		Level &l = m_levels[z];
+		const int shift = maxZoom - z;
+		l.width = (width + (1 << shift) - 1) >> shift;
+		l.height = (height + (1 << shift) - 1) >> shift;
+		l.tilesX = (l.width + TILE_SIZE - 1) / TILE_SIZE;
+		l.tileRow = 0;
+		l.lines = 0;
+		l.band.assign(l.tilesX * TILE_SIZE * TILE_SIZE, m_background);
+		l.hasPending = false;
+		if (z > 0) {
+			l.pending.resize(l.width);
+			l.half.resize((l.width + 1) / 2);
+		}
+	}
+
+	const std::string ext = ".mbtiles";
+	if (path.size() > ext.size() &&
+		path.compare(path.size() - ext.size(), ext.size(), ext) == 0)
+		m_store.reset(new MBTilesStore(path, tileOptions, m_settings, maxZoom));
+	else
+		m_store.reset(new DirectoryStore(path, tileOptions, m_settings));
+}
+
+void TileWriter::writeRow(const Color *row)
+{
+	addLine(maxZoom(), row);
+}
+
+void TileWriter::addLine(int z, const Color *line)
+{
+	Level &l = m_levels[z];
+	assert(l.lines < TILE_SIZE);
+	std::copy(line, line + l.width, &l.band[l.lines * l.tilesX * TILE_SIZE]);
+	if (++l.lines == TILE_SIZE)
+		writeTiles(z);
+
+	if (z == 0)
+		return;
+	if (!l.hasPending) {
+		std::copy(line, line + l.width, l.pending.begin());
+		l.hasPending = true;
+		return;
+	}
+	reduce(z, l.pending.data(), line);
+	l.hasPending = false;
+	addLine(z - 1, l.half.data());
+}
+
+void TileWriter::reduce(int z, const Color *line1, const Color *line2)
+{
+	Level &l = m_levels[z];
+	// 2x2 box filter, past the right edge is background
+	auto get = [&] (const Color *line, int x) {
+		return x < l.width ? line[x] : m_background;
+	};
+	for (int x = 0; x < static_cast<int>(l.half.size()); x++) {
+		const Color c[4] = {
+			line1[2 * x], get(line1, 2 * x + 1),
+			line2[2 * x], get(line2, 2 * x + 1),
+		};
+		Color &out = l.half[x];
+		out.r = (c[0].r + c[1].r + c[2].r + c[3].r + 2) / 4;
+		out.g = (c[0].g + c[1].g + c[2].g + c[3].g + 2) / 4;
+		out.b = (c[0].b + c[1].b + c[2].b + c[3].b + 2) / 4;
+		out.a = (c[0].a + c[1].a + c[2].a + c[3].a + 2) / 4;
+	}
+}
+
+void TileWriter::writeTiles(int z)
+{
+	Level &l = m_levels[z];
+	const int stride = l.tilesX * TILE_SIZE;
+	for (int tx = 0; tx < l.tilesX; tx++) {
+		const Color *pixels = &l.band[tx * TILE_SIZE];
+		Hash64 hasher(m_settings);
+		for (int y = 0; y < TILE_SIZE; y++)
+			hasher.update(&pixels[y * stride], TILE_SIZE * sizeof(Color));
+		const uint64_t hash = hasher.digest();
+
+		switch (m_store->reuse(z, tx, l.tileRow, hash)) {
+			case TILE_UNCHANGED:
+				m_unchanged++;
+				break;
+			case TILE_LINKED:
+				m_linked++;
+				break;
+			default:
+				m_store->write(z, tx, l.tileRow, hash, pixels, stride);
+				m_encoded++;
+		}
+	}
+	l.tileRow++;
+	l.lines = 0;
+}
+
+void TileWriter::finish()
+{
+	// the levels need to be finished from the top, each one feeds the next
+	const std::vector<Color> background(m_levels.back().width, m_background);
+	for (int z = maxZoom(); z >= 0; z--) {
+		Level &l = m_levels[z];
+		if (z > 0 && l.hasPending) {
+			reduce(z, l.pending.data(), background.data());
+			l.hasPending = false;
+			addLine(z - 1, l.half.data());
+		}
+		if (l.lines > 0) {
+			const int stride = l.tilesX * TILE_SIZE;
+			std::fill(l.band.begin() + l.lines * stride, l.band.end(), m_background);
+			writeTiles(z);
+		}
+		assert(l.tileRow == (l.height + TILE_SIZE - 1) / TILE_SIZE);
+	}
+
+	const size_t removed = m_store->finish();
+	verbosestream << "Tiles: " << m_encoded << " encoded, " << m_linked
+		<< " linked to identical ones, " << m_unchanged << " unchanged, "
+		<< removed << " removed" << std::endl;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "Encoder.h"
+
+enum {
+	TILE_ENCODE,    // the tile needs to be encoded, see TileStore::write()
+	TILE_LINKED,    // stored as a reference to an identical tile
+	TILE_UNCHANGED, // already there from the last run
+};
+
+/*
+ * Where TileWriter puts the tiles. Tiles are known by a hash of their pixels
+ * and how they are encoded, so a store can keep identical tiles only once and
+ * leave alone what didn't change since the last run.
+ */
+class TileStore {
+public:
+	virtual ~TileStore() {}
+
+	// stores the tile without encoding it if possible, returns one of TILE_*
+	virtual int reuse(int z, int x, int y, uint64_t hash) = 0;
+	// encodes and stores a tile, pixels has rows stride pixels apart
+	virtual void write(int z, int x, int y, uint64_t hash,
+		const Color *pixels, int stride) = 0;
+	// removes the tiles left from the last run and returns how many
+	virtual size_t finish() = 0;
+	virtual size_t bytesWritten() const = 0;
+};
+
+/*
+ * Cuts the image into a pyramid of 256x256 tiles as used by web maps. The
+ * highest zoom level has the image at full size, each level below is half
+ * as big as the one above. Tiles are written as soon as a row of them is
+ * complete and lower levels are reduced line by line, so only one row of
+ * tiles per level is kept in memory. Tiles past the edge of the image are
+ * filled with background.
+ *
+ * Tiles go to <path>/<zoom>/<x>/<y>.png with a manifest.txt listing their
+ * hashes, or into an MBTiles archive if path ends in ".mbtiles".
+ */
+class TileWriter : public Encoder {
+public:
+	static constexpr int TILE_SIZE = 256;
+
+	TileWriter(const std::string &dir, int width, int height,
+		const EncoderOptions &options, const Color &background);
+
+	TileWriter(const TileWriter&) = delete;
+	TileWriter& operator=(const TileWriter&) = delete;
+
+	void writeRow(const Color *row) override;
+	void finish() override;
+	size_t bytesWritten() const override { return m_store->bytesWritten(); }
+	bool buffered() const override { return false; }
+
+	int maxZoom() const { return static_cast<int>(m_levels.size()) - 1; }
+
+private:
+	struct Level {
+		int width, height; // of the image at this level
+		int tilesX;
+		int tileRow; // being filled
+		int lines; // in the current tile row
+		std::vector<Color> band; // tilesX * TILE_SIZE wide, TILE_SIZE high
+		// the last line if it still needs its partner for the level below
+		std::vector<Color> pending;
+		bool hasPending;
+		std::vector<Color> half; // the two lines reduced for the level below
+	};
+
+	void addLine(int z, const Color *line);
+	// reduces two lines of level z into its half
+	void reduce(int z, const Color *line1, const Color *line2);
+	void writeTiles(int z);
+
+	Color m_background;
+	std::vector<Level> m_levels; // index is the zoom level
+	std::unique_ptr<TileStore> m_store;
+	uint64_t m_settings; // hash of what affects the encoded files
+	size_t m_encoded, m_linked, m_unchanged;
+};
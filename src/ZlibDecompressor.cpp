@@ -29,12 +29,24 @@ void ZlibDecompressor::setSeekPos(size_t seekPos)
 }
 
 void ZlibDecompressor::decompress(ustring &buffer)
+{
+	decompress(&buffer);
+}
+
+void ZlibDecompressor::skip()
+{
+	decompress(nullptr);
+}
+
+void ZlibDecompressor::decompress(ustring *buffer)
 {
 	const unsigned char *data = m_data + m_seekPos;
 	const size_t size = m_size - m_seekPos;
 
 	// output space is extended in chunks of this size
 	constexpr size_t BUFSIZE = 8 * 1024;
+	// or, if the output is unwanted, overwritten in this buffer
+	unsigned char discard[BUFSIZE];
 
 	z_stream strm;
 	strm.zalloc = Z_NULL;
@@ -48,18 +60,27 @@ void ZlibDecompressor::decompress(ustring &buffer)
 
 	strm.next_in = const_cast<unsigned char *>(data);
 	strm.avail_in = size;
-	if (buffer.empty())
-		buffer.resize(BUFSIZE);
-	strm.next_out = &buffer[0];
-	strm.avail_out = buffer.size();
+	if (buffer) {
+		if (buffer->empty())
+			buffer->resize(BUFSIZE);
+		strm.next_out = &(*buffer)[0];
+		strm.avail_out = buffer->size();
+	} else {
+		strm.next_out = discard;
+		strm.avail_out = BUFSIZE;
+	}
 
 	int ret = 0;
 	do {
 		ret = Z(inflate)(&strm, Z_NO_FLUSH);
 		if (strm.avail_out == 0) {
-			const auto off = buffer.size();
-			buffer.resize(off + BUFSIZE);
-			strm.next_out = &buffer[off];
+			if (buffer) {
+				const auto off = buffer->size();
+				buffer->resize(off + BUFSIZE);
+				strm.next_out = &(*buffer)[off];
+			} else {
+				strm.next_out = discard;
+			}
 			strm.avail_out = BUFSIZE;
 		}
 	} while (ret == Z_OK);
@@ -67,7 +88,7 @@ void ZlibDecompressor::decompress(ustring &buffer)
 		throw DecompressError();
 
 	m_seekPos += strm.next_in - data;
-	buffer.resize(buffer.size() - strm.avail_out);
+	if (buffer)
+		buffer->resize(buffer->size() - strm.avail_out);
 	(void) Z(inflateEnd)(&strm);
 }
-
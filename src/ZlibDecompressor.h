@@ -20,8 +20,12 @@ public:
 	// Decompress and return one zlib stream from the buffer
 	// Advances seekPos as appropriate.
 	void decompress(ustring &dst);
+	// Same as decompress() but throws the data away
+	void skip();
 
 private:
+	void decompress(ustring *dst);
+
 	const u8 *m_data;
 	size_t m_seekPos, m_size;
 };
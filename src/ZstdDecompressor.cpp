@@ -4,7 +4,8 @@
 ZstdDecompressor::ZstdDecompressor():
 	m_data(nullptr),
 	m_seekPos(0),
-	m_size(0)
+	m_size(0),
+	m_ended(false)
 {
 	m_stream = ZSTD_createDStream();
 }
@@ -21,31 +22,41 @@ void ZstdDecompressor::setData(const u8 *data, size_t size, size_t seekPos)
 	m_size = size;
 }
 
-void ZstdDecompressor::decompress(ustring &buffer)
+void ZstdDecompressor::start(ustring &buffer)
 {
+	ZSTD_initDStream(reinterpret_cast<ZSTD_DStream*>(m_stream));
+	m_ended = false;
+	buffer.clear();
+}
+
+void ZstdDecompressor::fill(ustring &buffer, size_t size)
+{
+	if (buffer.size() >= size || m_ended)
+		return;
+
 	ZSTD_DStream *stream = reinterpret_cast<ZSTD_DStream*>(m_stream);
 	ZSTD_inBuffer inbuf = { m_data, m_size, m_seekPos };
 
-	// output space is extended in chunks of this size
-	constexpr size_t BUFSIZE = 8 * 1024;
-
-	if (buffer.empty())
-		buffer.resize(BUFSIZE);
-	ZSTD_outBuffer outbuf = { &buffer[0], buffer.size(), 0 };
+	// output is produced in multiples of this size, so that small reads
+	// don't cause a call to zstd each
+	constexpr size_t CHUNKSIZE = 4 * 1024;
 
-	ZSTD_initDStream(stream);
+	size_t pos = buffer.size();
+	buffer.resize((size + CHUNKSIZE - 1) / CHUNKSIZE * CHUNKSIZE);
+	ZSTD_outBuffer outbuf = { &buffer[0], buffer.size(), pos };
 
-	size_t ret;
 	do {
-		ret = ZSTD_decompressStream(stream, &outbuf, &inbuf);
+		const size_t inPos = inbuf.pos, outPos = outbuf.pos;
+		size_t ret = ZSTD_decompressStream(stream, &outbuf, &inbuf);
 		if (ret && ZSTD_isError(ret))
 			throw DecompressError();
-		if (outbuf.size == outbuf.pos) {
-			outbuf.size += BUFSIZE;
-			buffer.resize(outbuf.size);
-			outbuf.dst = &buffer[0];
+		if (ret == 0) {
+			m_ended = true;
+			break;
 		}
-	} while (ret != 0);
+		if (inbuf.pos == inPos && outbuf.pos == outPos)
+			throw DecompressError(); // truncated
+	} while (outbuf.pos < size);
 
 	m_seekPos = inbuf.pos;
 	buffer.resize(outbuf.pos);
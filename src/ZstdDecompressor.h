@@ -17,12 +17,15 @@ public:
 	~ZstdDecompressor();
 	void setData(const u8 *data, size_t size, size_t seekPos);
 	size_t seekPos() const { return m_seekPos; }
-	// Decompress and return one zstd stream from the buffer
+	// Decompress one zstd stream only as far as needed: after start(), call
+	// fill() to make dst contain at least the given amount of bytes.
 	// Advances seekPos as appropriate.
-	void decompress(ustring &dst);
+	void start(ustring &dst);
+	void fill(ustring &dst, size_t size);
 
 private:
 	void *m_stream; // ZSTD_DStream
 	const u8 *m_data;
 	size_t m_seekPos, m_size;
+	bool m_ended; // stream was decompressed completely (see fill())
 };
@@ -38,6 +38,14 @@ static void usage()
 		{"--colors", "<path>"},
 		{"--scales", "[t][b][l][r]"},
 		{"--exhaustive", "never|y|full|auto"},
+		{"--threads", "<n>"},
+		{"--threadmode", "bands|pipeline|columns|auto"},
+		{"--noblockcache", ""},
+		{"--stream", ""},
+		{"--tiles", "<path>"},
+		{"--encoder", "png|fastpng|palette|raw|gd|auto"},
+		{"--png-level", "<0-9>"},
+		{"--png-filter", "none|sub|up|average|paeth|adaptive"},
 		{"--dumpblock", "x,y,z"},
 	};
 	const char *top_text =
@@ -125,6 +133,14 @@ int main(int argc, char *argv[])
 		{"noemptyimage", no_argument, 0, 'n'},
 		{"exhaustive", required_argument, 0, 'j'},
 		{"dumpblock", required_argument, 0, 'k'},
+		{"threads", required_argument, 0, 't'},
+		{"threadmode", required_argument, 0, 'T'},
+		{"noblockcache", no_argument, 0, 'B'},
+		{"stream", no_argument, 0, 'w'},
+		{"tiles", required_argument, 0, 'Y'},
+		{"encoder", required_argument, 0, 'N'},
+		{"png-level", required_argument, 0, 'L'},
+		{"png-filter", required_argument, 0, 'F'},
 		{"verbose", no_argument, 0, 'v'},
 		{0, 0, 0, 0}
 	};
@@ -133,6 +149,7 @@ int main(int argc, char *argv[])
 
 	std::string input;
 	std::string output;
+	std::string tiles;
 	std::string colors;
 	bool onlyPrintExtent = false;
 	BlockPos dumpblock(INT16_MIN);
@@ -248,6 +265,62 @@ int main(int argc, char *argv[])
 				}
 				break;
 			}
+			case 't':
+				generator.setThreads(stoi(optarg));
+				break;
+			case 'B':
+				generator.setBlockCache(false);
+				break;
+			case 'w':
+				generator.setStreaming(true);
+				break;
+			case 'Y':
+				tiles = optarg;
+				break;
+			case 'N': {
+					int encoder = ENCODER_AUTO;
+					if (!strcmp(optarg, "png"))
+						encoder = ENCODER_PNG;
+					else if (!strcmp(optarg, "fastpng"))
+						encoder = ENCODER_FASTPNG;
+					else if (!strcmp(optarg, "gd"))
+						encoder = ENCODER_GD;
+					else if (!strcmp(optarg, "palette"))
+						encoder = ENCODER_PALETTE;
+					else if (!strcmp(optarg, "raw"))
+						encoder = ENCODER_RAW;
+					generator.setEncoder(encoder);
+				}
+				break;
+			case 'L':
+				generator.setPngLevel(stoi(optarg));
+				break;
+			case 'F': {
+					int filter = PNG_FILTER_ADAPTIVE;
+					if (!strcmp(optarg, "none"))
+						filter = PNG_FILTER_NONE;
+					else if (!strcmp(optarg, "sub"))
+						filter = PNG_FILTER_SUB;
+					else if (!strcmp(optarg, "up"))
+						filter = PNG_FILTER_UP;
+					else if (!strcmp(optarg, "average"))
+						filter = PNG_FILTER_AVERAGE;
+					else if (!strcmp(optarg, "paeth"))
+						filter = PNG_FILTER_PAETH;
+					generator.setPngFilter(filter);
+				}
+				break;
+			case 'T': {
+					int mode = THREADS_AUTO;
+					if (!strcmp(optarg, "bands"))
+						mode = THREADS_BANDS;
+					else if (!strcmp(optarg, "pipeline"))
+						mode = THREADS_PIPELINE;
+					else if (!strcmp(optarg, "columns"))
+						mode = THREADS_COLUMNS;
+					generator.setThreadMode(mode);
+				}
+				break;
 			case 'v':
 				configure_log_streams(true);
 				break;
@@ -256,6 +329,16 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (!tiles.empty()) {
+		if (!output.empty()) {
+			errorstream << "Only one of -o and --tiles can be given." << std::endl;
+			return 1;
+		}
+		// the directory takes the place of the output image
+		output = tiles;
+		generator.setTiles(true);
+	}
+
 	const bool need_output = !onlyPrintExtent && dumpblock.x == INT16_MIN;
 	if (input.empty() || (need_output && output.empty())) {
 		usage();
@@ -1,7 +1,17 @@
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "util.h"
 
@@ -74,3 +84,73 @@ bool dir_exists(const char *path)
 	struct stat s{};
 	return stat(path, &s) == 0 && (s.st_mode & S_IFDIR) == S_IFDIR;
 }
+
+size_t file_size(const char *path)
+{
+	struct stat s{};
+	return stat(path, &s) == 0 ? s.st_size : 0;
+}
+
+void create_dir(const std::string &path)
+{
+#ifdef _WIN32
+	const int ret = _mkdir(path.c_str());
+#else
+	const int ret = mkdir(path.c_str(), 0755);
+#endif
+	if (ret != 0 && !(errno == EEXIST && dir_exists(path.c_str()))) {
+		std::ostringstream oss;
+		oss << "Error creating directory " << path << ": " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+bool remove_empty_dir(const std::string &path)
+{
+#ifdef _WIN32
+	return _rmdir(path.c_str()) == 0;
+#else
+	return rmdir(path.c_str()) == 0;
+#endif
+}
+
+bool hard_link(const std::string &target, const std::string &path)
+{
+#ifdef _WIN32
+	(void)target;
+	(void)path;
+	return false;
+#else
+	return link(target.c_str(), path.c_str()) == 0;
+#endif
+}
+
+void replace_file(const std::string &from, const std::string &path)
+{
+#ifdef _WIN32
+	// rename() doesn't replace files here
+	std::remove(path.c_str());
+#endif
+	if (std::rename(from.c_str(), path.c_str()) != 0) {
+		std::ostringstream oss;
+		oss << "Error renaming " << from << " to " << path << ": " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+FILE *open_output(const std::string &filename)
+{
+	if (filename == "-") {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		return stdout;
+	}
+	FILE *f = fopen(filename.c_str(), "wb");
+	if (!f) {
+		std::ostringstream oss;
+		oss << "Error opening image file: " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	return f;
+}
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <iostream>
+#include <cstdio>
 
 #define ARRLEN(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -25,3 +26,21 @@ std::string read_setting_default(const std::string &name, std::istream &is,
 bool file_exists(const char *path);
 
 bool dir_exists(const char *path);
+
+// 0 if it doesn't exist
+size_t file_size(const char *path);
+
+// creates a directory unless it exists already
+void create_dir(const std::string &path);
+
+// false if it isn't empty
+bool remove_empty_dir(const std::string &path);
+
+// false if that isn't possible, e.g. on a different file system
+bool hard_link(const std::string &target, const std::string &path);
+
+// moves a file to path, replacing what is there
+void replace_file(const std::string &from, const std::string &path);
+
+// opens a file for writing in binary mode, "-" is stdout (which must not be closed)
+FILE *open_output(const std::string &filename);
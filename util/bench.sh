@@ -0,0 +1,27 @@
+#!/bin/bash
+# times the renderer on a world for the common flag combinations
+# usage: util/bench.sh <world> [runs] [minetestmapper binary]
+set -eo pipefail
+world=$1
+runs=${2:-5}
+bin=${3:-./minetestmapper}
+[ -d "$world" ] || { echo "usage: $0 <world> [runs] [binary]" >&2; exit 1; }
+out=$(mktemp --suffix=.png)
+trap 'rm -f "$out"' EXIT
+
+# best wall time of $runs runs in milliseconds, for the args ($1 ...)
+besttime () {
+	local best= t0 t
+	for _ in $(seq "$runs"); do
+		t0=$(date +%s%N)
+		"$bin" -i "$world" -o "$out" "$@" >/dev/null 2>&1
+		t=$(( ($(date +%s%N) - t0) / 1000000 ))
+		[[ -z "$best" || $t -lt $best ]] && best=$t
+	done
+	echo "$best"
+}
+
+for args in "" "--drawalpha" "--noshading" "--drawalpha --noshading" \
+	"--zoom 4" "--noblockcache" "--drawalpha --noblockcache"; do
+	printf '%-30s %6s ms\n' "${args:-(default)}" "$(besttime $args)"
+done
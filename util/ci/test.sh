@@ -42,6 +42,43 @@ checkmap () {
 	echo "Passed."
 }
 
+# check that tiles up to zoom level $1 were written with the args ($2 ...)
+checktiles () {
+	local z=$1
+	shift
+	rm -rf tiles
+	./minetestmapper --noemptyimage -v -i ./testmap --tiles tiles "$@"
+	if [[ ! -f tiles/0/0/0.png || ! -d tiles/$z || -d tiles/$((z + 1)) ]]; then
+		echo "Tiles not generated as expected!"
+		exit 1
+	fi
+	echo "Passed."
+}
+
+# check that writing tiles with the args ($1 ...) returned an error
+checktileserr () {
+	local r=0
+	./minetestmapper --noemptyimage -v -i ./testmap "$@" || r=1
+	if [ $r -eq 0 ]; then
+		echo "Did not return error!"
+		exit 1
+	fi
+	echo "Passed."
+}
+
+# check that the args ($1 ...) give exactly the same pixels as a single thread
+checkthreads () {
+	rm -f ref.ppm map.ppm
+	./minetestmapper --noemptyimage -v -i ./testmap -o ref.ppm "$@" --threads 1
+	./minetestmapper --noemptyimage -v -i ./testmap -o map.ppm "$@"
+	if ! cmp ref.ppm map.ppm; then
+		echo "Output differs from a single thread!"
+		exit 1
+	fi
+	rm -f ref.ppm map.ppm
+	echo "Passed."
+}
+
 # check that invocation returned an error
 checkerr () {
 	local r=0
@@ -112,10 +149,105 @@ INSERT INTO blocks SELECT 2, 2, 3, d FROM d;
 checkmap 1 --geometry 32:32+16+16 --min-y 32 --max-y $((32+16-1)) --exhaustive $exh
 done
 
+msg "new schema: threads"
+# steps in height between the rows, so that shading across them shows
+writemap "
+$schema_new
+INSERT INTO blocks SELECT 0, 0, 0, d FROM d;
+INSERT INTO blocks SELECT 1, 0, 0, d FROM d;
+INSERT INTO blocks SELECT 0, 1, 1, d FROM d;
+INSERT INTO blocks SELECT 0, 0, 2, d FROM d;
+INSERT INTO blocks SELECT 1, 1, 3, d FROM d;
+"
+checkthreads --threads 3
+checkthreads --threads 8 --exhaustive full --geometry 0:0+32+64 --min-y 0 --max-y 15
+checkthreads --threads 3 --threadmode pipeline
+checkthreads --threads 2 --threadmode pipeline --exhaustive y --min-y 0 --max-y 15
+checkthreads --threads 3 --threadmode bands
+checkthreads --threads 4 --threadmode bands --zoom 2
+checkthreads --threads 4 --threadmode columns --exhaustive full --geometry 0:0+32+64 --min-y 0 --max-y 15
+
+msg "new schema: block cache"
+checkmap 1 --noblockcache
+checkmap 1 --threads 2 --min-y 0 --max-y 31
+
 msg "new schema: empty map"
 writemap "$schema_new"
 checkmap 0
 
+msg "new schema: sparse map"
+# two blocks far apart leave most of the image tiles untouched
+writemap "
+$schema_new
+INSERT INTO blocks SELECT 0, 0, 0, d FROM d;
+INSERT INTO blocks SELECT 40, 0, 40, d FROM d;
+"
+checkmap 1
+checkmap 1 --zoom 2 --drawscale --threads 3 --threadmode columns
+
+msg "new schema: streaming"
+checkmap 1 --stream
+checkmap 1 --stream --zoom 3 --threads 3 --threadmode columns
+checkmap 1 --stream --threads 2 --threadmode bands --noshading
+checkthreads --stream --threads 3 --threadmode bands
+checkthreads --stream --threads 3 --threadmode columns
+checkerr --stream --drawscale
+
+msg "new schema: png options"
+checkmap 1 --png-level 1 --png-filter up
+checkmap 1 --png-level 9 --png-filter paeth --zoom 40 --threads 4
+checkmap 1 --png-level 0 --png-filter none --stream --zoom 30 --threads 3
+checkmap 1 --encoder fastpng
+checkmap 1 --encoder fastpng --stream --threads 2
+checkmap 1 --encoder gd --stream
+checkmap 1 --encoder png --png-level 9
+checkmap 1 --encoder palette
+checkmap 1 --encoder palette --drawalpha --drawscale --zoom 2
+checkmap 1 --encoder palette --stream --threads 3
+checkmap 1 --encoder raw
+checkmap 1 --encoder raw --stream --zoom 2
+
+msg "new schema: tiles"
+checktiles 2
+checktiles 3 --zoom 2 --threads 3
+checktiles 2 --encoder palette --threadmode columns --threads 2
+# a second run keeps the unchanged tiles
+./minetestmapper -v -i ./testmap --tiles tiles --encoder palette
+grep -q "^0/0/0 " tiles/manifest.txt
+# a zoom level no longer needed goes away completely
+./minetestmapper -v -i ./testmap --tiles tiles --encoder palette --zoom 2
+./minetestmapper -v -i ./testmap --tiles tiles --encoder palette
+[[ -d tiles/2 && ! -d tiles/3 ]]
+checktileserr --tiles tiles --draworigin
+rm -rf tiles
+# -o can't be given as well
+checkerr --tiles tiles
+checktileserr -o map.png --tiles tiles
+[ ! -e tiles ]
+# the same into an MBTiles file, twice
+./minetestmapper -v -i ./testmap --tiles tiles.mbtiles
+./minetestmapper -v -i ./testmap --tiles tiles.mbtiles
+[ "$(sqlite3 tiles.mbtiles "SELECT count(*) FROM tiles WHERE zoom_level = 0")" = 1 ]
+checktileserr --tiles tiles.mbtiles --encoder raw
+rm -f tiles.mbtiles
+
+msg "new schema: streaming memory"
+# a map 6 image tiles high, rows far apart must not be in memory at once
+writemap "
+$schema_new
+WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i < 95)
+INSERT INTO blocks SELECT a.i, 0, b.i, d FROM d, n a, n b WHERE a.i < 16;
+"
+for mode in auto pipeline; do
+	kept=$(./minetestmapper -v -i ./testmap -o map.png --stream --threads 4 --threadmode $mode 2>&1 |
+		grep -o "Kept at most [0-9]* of 6 image tiles" | grep -o "[0-9]*" | head -1)
+	if [[ -z "$kept" || $kept -gt 2 ]]; then
+		echo "Kept ${kept:-?} image tiles in memory with $mode!"
+		exit 1
+	fi
+	echo "Passed."
+done
+
 msg "drawplayers"
 writemap "
 $schema_new
@@ -146,3 +278,4 @@ $schema_new
 INSERT INTO blocks VALUES (0, 0, 0, x'$(cat util/ci/test_block2)');
 "
 checkerr
+checkerr --threads 2 --threadmode pipeline